@@ -23,6 +23,35 @@
 ChangeLogs
 ----------
 
+* Unreleased - v0.0.4
+  - Pluggable port I/O backend, software EC emulator
+  - Benchmark (make bench)
+  - One EC session per process, optionally drop root after opening
+  - Burst mode for bulk register reads
+  - Adaptive spin-then-sleep status polling
+  - Transaction deadlines, retries and recovery of a stuck EC
+  - Register snapshot, each register read at most once per invocation
+  - Table driven register map
+  - -g takes field names, addresses and ranges
+  - Watch mode
+  - EC broker (--serve), other invocations become its clients
+  - Seqlock protected shared memory snapshot (--publish, --from-shm)
+  - ec_sys backend, preferred over raw port I/O when available
+  - /dev/port backend
+  - Batch mode (--batch), many commands in one session
+  - Bit changes to one register are merged into one read and one write
+  - Multi-byte fields are read without tearing
+  - Transaction statistics and latency histograms (--stats)
+  - Port trace recorder (--trace) and replay backend (--replay)
+  - Static fields are cached on disk across invocations
+  - Prometheus textfile exporter (--export)
+  - Inter-process lock around each EC transaction
+  - Rate limit shared by all processes (--rate)
+  - Event driven monitor (--monitor), emulator raises synthetic events
+  - Rules running commands or writing to a FIFO on field changes (--on)
+  - Battery telemetry recorder to a delta encoded ring file (--record,
+    --decode)
+
 * Sat, 12 Sep 2009 11:52:47 +0700 - v0.0.3
   - Long options
   - Bluetooth, touchpad, wireless can be on/off explicitly
@@ -40,12 +69,30 @@ Known Issues
 
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <grp.h>
+#include <signal.h>
 #include <time.h>
 #include <getopt.h>
+#include <poll.h>
+#include <sys/file.h>
 #include <sys/io.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #define VERSION "0.0.3"
 
@@ -58,75 +105,1085 @@ Known Issues
 #define WR_EC 0x81
 #define BE_EC 0x82
 #define BD_EC 0x83
+#define QR_EC 0x84
+
+/* EC Status */
+#define EC_OBF 0x01
+#define EC_IBF 0x02
+#define EC_CMD 0x08
+#define EC_BURST 0x10
+#define EC_SCI_EVT 0x20
+
+/* Burst Acknowledge */
+#define EC_BURST_ACK 0x90
+#define BURST_ACK_TIMEOUT 1000000L
+
+/* Transaction deadline (ns) and retries */
+#define EC_TIMEOUT 100000000L
+#define EC_RETRIES 2
+
+/* Re-reads of a multi-byte field that keeps changing */
+#define TEAR_RETRIES 8
+
+/* EC errors, returned negated */
+enum ec_error
+{
+  EC_OK = 0,
+  EC_ETIMEDOUT,
+  EC_EIO,
+  EC_EPERM,
+  EC_EVERIFY
+};
+
+/* Shared memory snapshot */
+#define SHM_NAME "/acer-ec"
+#define SHM_MAGIC 0x41454331    /* AEC1 */
+
+/* /dev/port */
+#define DEVPORT_PATH "/dev/port"
+
+/* ec_sys debugfs node */
+#define ECSYS_PATH "/sys/kernel/debug/ec/ec0/io"
+#define ECSYS_GAP 4             /* read through gaps up to this size */
+
+/* --monitor event sources */
+#define ACPI_INTERRUPTS "/sys/firmware/acpi/interrupts"
+#define EC_GPE_PATH "/sys/kernel/debug/ec/ec0/gpe"
+#define MONITOR_TICK 50         /* ms */
+#define MONITOR_QUERIES 8       /* drained per tick */
+
+/* --on rules */
+#define RULES_MAX 32
+#define HOOKS_MAX 16            /* commands running at once */
+
+/* --record ring file */
+#define RING_MAGIC 0x52434541   /* AECR */
+#define RING_VERSION 1
+#define RING_BLOCK 4096
+#define RING_SIZE 1024          /* KB */
+#define RING_CHANNELS 5
+#define RING_SAMPLE_MAX (5 * (RING_CHANNELS + 1)) /* varints */
+
+/* Inter-process EC lock */
+#define LOCK_PATH "/run/acer-ec.lock"
+#define BUCKET_MAGIC 0x42434541 /* AECB */
+
+/* Static field cache */
+#define STATIC_CACHE "/var/cache/acer-ec.cache"
+#define STATIC_MAGIC 0x53434541 /* AECS */
+
+/* Port trace */
+#define TRACE_MAGIC 0x54434541  /* AECT */
+#define TRACE_VERSION 1
+#define TRACE_BUFFER 512        /* records */
+
+/* Broker defaults */
+#define BROKER_SOCKET "/run/acer-ec.sock"
+#define BROKER_CLIENTS 64
+#define BROKER_TTL 100          /* ms */
+
+/* Emulator latency per byte (ns) */
+#define EMUL_LATENCY 10000
+#define EMUL_BURST_LATENCY 2000
+
+/* Polling defaults (ns) */
+#define POLL_SPIN 50000
+#define POLL_SPIN_MAX 200000
+#define POLL_SLEEP_MIN 20000
+#define POLL_SLEEP_MAX 500000
+
+
+/* Long only options */
+enum
+{
+  OPT_BACKEND = 256,
+  OPT_BATCH,
+  OPT_BENCH,
+  OPT_CACHE_TTL,
+  OPT_DECODE,
+  OPT_DEVPORT,
+  OPT_DROP_PRIVILEGES,
+  OPT_ECSYS,
+  OPT_EMUL,
+  OPT_EXPORT,
+  OPT_FROM_SHM,
+  OPT_INTERVAL,
+  OPT_LOCK,
+  OPT_MONITOR,
+  OPT_NO_BURST,
+  OPT_ON,
+  OPT_POLL,
+  OPT_PUBLISH,
+  OPT_RATE,
+  OPT_RECORD,
+  OPT_REFRESH,
+  OPT_REPLAY,
+  OPT_RETRIES,
+  OPT_SERVE,
+  OPT_SOCKET,
+  OPT_STATIC_CACHE,
+  OPT_STATS,
+  OPT_TIMEOUT,
+  OPT_TRACE,
+  OPT_VERIFY,
+  OPT_WATCH
+};
+
+struct ec_session;
+
+/* 
+ * --trace record, one port operation.  A trace is a sequence of 
+ * sessions, each starting with a TRACE_START record that carries 
+ * TRACE_MAGIC in delta and TRACE_VERSION in port.
+ */
+#define TRACE_START 0
+#define TRACE_IN 1
+#define TRACE_OUT 2
+
+struct ec_trace
+{
+  uint32_t delta;               /* ns since previous record, saturated */
+  uint8_t op;
+  uint8_t port;
+  uint8_t data;
+  uint8_t pad;
+};
+
+/* Port I/O backend */
+struct ec_backend
+{
+  const char *name;
+  int (*open) (struct ec_session *);
+  void (*close) (struct ec_session *);
+  unsigned char (*in) (struct ec_session *, unsigned char port);
+  void (*out) (struct ec_session *, unsigned char data, unsigned char port);
+  /* register level backends, bypass the port protocol */
+  int (*read) (struct ec_session *, const unsigned char *addrs, int n,
+               unsigned char *regs);
+  int (*write) (struct ec_session *, unsigned char addr, unsigned char data);
+  /* read-modify-write done by the backend, returns the value written */
+  int (*update) (struct ec_session *, unsigned char addr, 
+                 unsigned char clear, unsigned char set, unsigned char flip);
+};
+
+/* Software EC, follows ACPI EC state machine */
+struct ec_emul
+{
+  unsigned char regs[256];
+  unsigned char status;
+  unsigned char cmd;
+  unsigned char addr;
+  unsigned char data;
+  int phase;
+  int pending;
+  int no_burst;                 /* refuse BE_EC */
+  int drop;                     /* lose every n-th command */
+  int churn;                    /* added to BRC0 per command */
+  int commands;
+  long event;                   /* ns between synthetic events */
+  long long next_event;
+  int events;
+  unsigned char query;          /* pending for QR_EC */
+  long latency;                 /* ns per byte */
+  long burst_latency;           /* ns per byte in burst mode */
+  long long ready;              /* busy until (ns) */
+};
+
+/* --trace recorder, hooks in/out of the session backend */
+struct ec_tracer
+{
+  int fd;
+  struct ec_backend backend;    /* copy with in/out hooked */
+  const struct ec_backend *inner;
+  long long last;
+  int n;
+  struct ec_trace buf[TRACE_BUFFER];
+};
+
+/* 
+ * On-disk copy of the registers behind F_STATIC fields, valid for the
+ * machine (PJID) and battery (BSN0) in key.
+ */
+struct ec_static
+{
+  uint32_t magic;
+  unsigned char key[3];
+  unsigned char pad;
+  unsigned char valid[32];      /* bitmap */
+  unsigned char regs[256];
+};
+
+/* Replay backend state, the trace file is mapped */
+struct ec_replay
+{
+  const struct ec_trace *rec;
+  size_t n;
+  size_t pos;
+  long long start;              /* monotonic time of record 0 */
+  long long at;                 /* recorded time of pos */
+};
+
+/* Latency histogram, bucket i holds [2^(i-1), 2^i) ns */
+#define HIST_BUCKETS 40
+
+struct ec_hist
+{
+  unsigned long count;
+  long long sum;
+  long long max;
+  unsigned long bucket[HIST_BUCKETS];
+};
+
+/* --stats output */
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* Transaction counters */
+struct ec_stats
+{
+  unsigned long transactions;
+  unsigned long bytes_read;
+  unsigned long bytes_written;
+  unsigned long syscalls;
+  unsigned long retries;
+  unsigned long recoveries;
+  unsigned long spins;
+  unsigned long sleeps;
+  unsigned long snapshot_regs;
+  unsigned long bursts;
+  unsigned long burst_bytes;
+  unsigned long tear_retries;
+  unsigned long lock_waits;     /* lock held by another process */
+  unsigned long throttled;      /* waits for a --rate token */
+  unsigned long events;         /* SCI queries or interrupts seen */
+  unsigned long hooks;          /* --on actions run */
+  unsigned long hooks_dropped;  /* too many running, FIFO full */
+  long long init_ns;            /* cost of init_port() */
+  struct ec_hist read;          /* one register */
+  struct ec_hist write;
+  struct ec_hist pass;          /* burst or register level read */
+  struct ec_hist ibf;           /* wait for input buffer empty */
+  struct ec_hist obf;           /* wait for output buffer full */
+  struct ec_hist lock;          /* wait for the EC lock */
+  struct ec_hist rate;          /* wait for a --rate token */
+};
+
+/* 
+ * --rate token bucket, kept in the lock file and updated under the 
+ * lock so that all acer-ec processes draw from one budget.
+ */
+struct ec_bucket
+{
+  uint32_t magic;
+  uint32_t pad;
+  double tokens;                /* negative: reserved ahead */
+  int64_t stamp;                /* last refill, CLOCK_MONOTONIC ns */
+};
+
+/* Result of one --bench stress process */
+struct ec_stress
+{
+  unsigned long transactions;
+  unsigned long lock_waits;
+  long long lock_ns;
+  unsigned long errors;
+};
+
+/* Status polling: spin, then sleep with exponential backoff */
+struct ec_poll
+{
+  long spin;                    /* ns to spin before sleeping */
+  long sleep_min;               /* first sleep (ns) */
+  long sleep_max;               /* backoff cap (ns) */
+  long typical;                 /* learned EC response time (ns) */
+  int learn;                    /* derive spin from typical */
+  char *file;                   /* keep typical across runs */
+};
+
+/* Field flags */
+#define F_HEX 0x01              /* print raw bytes in hex */
+#define F_BE 0x02               /* most significant byte first */
+#define F_STATIC 0x04           /* does not change at runtime */
+
+/* Named field in the EC register file, after DSDT of AOD150 */
+struct ec_field
+{
+  const char *name;
+  unsigned char offset;
+  unsigned char width;          /* bytes */
+  unsigned char mask;           /* single byte fields */
+  unsigned char shift;
+  unsigned char flags;
+};
+
+/* One item of a -g list: a field or a register range */
+struct ec_query
+{
+  const struct ec_field *field;
+  int first, last;
+};
+
+/* On/off switch, shared by the command line and --batch */
+struct ec_switch
+{
+  const char *name;
+  const char *label;            /* for "X is now on." */
+  unsigned char reg;
+  unsigned char bit;
+  int inverted;                 /* bit set means off */
+  int (*on) (struct ec_session *);
+  int (*off) (struct ec_session *);
+  int (*toggle) (struct ec_session *);
+};
+
+/* Pending read-modify-writes, see plan_update() */
+struct ec_plan
+{
+  unsigned char clear[256];
+  unsigned char set[256];
+  unsigned char flip[256];      /* bits neither cleared nor set */
+  unsigned char notify[256];    /* switch bits to report once written */
+  unsigned char order[256];     /* registers in first queued order */
+  int n;
+  unsigned char queued[32];     /* bitmap */
+};
+
+/* Broker protocol, one SOCK_SEQPACKET message each way */
+#define BROKER_READ 1
+#define BROKER_WRITE 2
+#define BROKER_UPDATE 3         /* read-modify-write */
+
+struct ec_request
+{
+  unsigned char op;
+  unsigned char addr;           /* write, update */
+  unsigned char data;           /* write */
+  unsigned char clear;          /* update */
+  unsigned char set;
+  unsigned char flip;
+  unsigned char want[32];       /* read, bitmap of registers */
+};
+
+struct ec_reply
+{
+  int err;
+  int error_reg;
+  unsigned char regs[256];
+};
+
+/* 
+ * Snapshot published in shared memory.  seq is odd while the sampler
+ * updates the segment; readers retry until they copy an even, 
+ * unchanged seq.
+ */
+struct ec_shm
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t generation;
+  int64_t timestamp;            /* CLOCK_MONOTONIC, ns */
+  unsigned char valid[32];
+  unsigned char regs[256];
+};
+
+/* Metric written by --export, one sample of a field */
+struct ec_metric
+{
+  const char *name;
+  const char *help;
+  const char *label;            /* name="value", or NULL */
+  const char *field;
+  unsigned char mask;           /* of the field value, 0 for all */
+  double scale;
+};
+
+/* Rule conditions */
+#define RULE_CHANGE 0
+#define RULE_RISE 1             /* zero to non-zero */
+#define RULE_FALL 2
+#define RULE_ABOVE 3            /* crossing a threshold */
+#define RULE_BELOW 4
+
+/* --on=FIELD[&MASK][COND]:ACTION */
+struct ec_rule
+{
+  const struct ec_field *field;
+  unsigned long mask;
+  int cond;
+  long level;
+  long rearm;                   /* hysteresis, level without */
+  int armed;
+  const char *action;           /* shell command, or "|FIFO" */
+  int fifo;
+};
+
+/* 
+ * Rules compiled to a mask per register: a sample costs one compare per
+ * register some rule looks at, and only rules on a changed register are
+ * evaluated.
+ */
+struct ec_rules
+{
+  struct ec_rule rule[RULES_MAX];
+  int n;
+  unsigned char mask[256];      /* bits looked at by any rule */
+  uint32_t which[256];          /* rules looking at the register */
+  unsigned char regs[256];      /* registers in use, in order */
+  int nregs;
+  unsigned char prev[256];
+  int primed;
+  int running;                  /* commands not yet reaped */
+};
+
+/* 
+ * --record file: this header, then a ring of RING_BLOCK sized blocks.
+ * Each block opens with a keyframe, absolute values and wall clock 
+ * time, followed by samples: milliseconds since the previous sample 
+ * (CLOCK_MONOTONIC) and the change of each channel, as varints.
+ */
+struct ec_ring
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t channels;
+  uint32_t block_size;
+  uint32_t blocks;
+  uint32_t head;                /* block being written */
+  uint32_t seq;                 /* of the head block */
+};
+
+struct ec_ring_block
+{
+  uint32_t seq;                 /* 0 while the block is reset */
+  uint32_t used;                /* bytes of samples after the keyframe */
+  int64_t time;                 /* keyframe, ms since the epoch */
+  uint32_t key[RING_CHANNELS];
+};
+
+/* Field sampled by --watch */
+struct ec_watch
+{
+  const struct ec_field *field;
+  long long interval;           /* ns, 0 for static fields */
+  long long due;
+  unsigned long value;
+  int seen;
+};
+
+/* Shadow image of the register file */
+struct ec_snapshot
+{
+  unsigned char regs[256];
+  unsigned char want[32];       /* bitmap, registers to capture */
+  unsigned char valid[32];      /* bitmap, registers captured */
+};
+
+/* EC session, opened once per process */
+struct ec_session
+{
+  const struct ec_backend *backend;
+  int auto_backend;             /* use the broker when it runs */
+  int writes;                   /* the command line may write */
+  int opened;
+  int drop_privileges;
+  int no_burst;
+  int in_burst;
+  struct ec_poll poll;
+  long timeout;                 /* per transaction (ns) */
+  int retries;
+  long long deadline;
+  int error_reg;
+  struct ec_snapshot snap;
+  struct ec_plan plan;
+  int verify;                   /* read back planned writes */
+  int stats_format;             /* --stats, 0 if not given */
+  const char *socket;
+  long cache_ttl;               /* broker, ns */
+  const char *shm_name;
+  const char *ecsys_path;
+  const char *devport_path;
+  const char *trace_path;
+  const char *replay_path;
+  struct ec_tracer *tracer;
+  const char *static_path;      /* NULL: default, "": no cache */
+  int static_state;             /* 0 unchecked, 1 usable, -1 off */
+  int static_dirty;
+  int refresh;                  /* ignore the cached values */
+  struct ec_static statics;
+  const char *lock_path;        /* NULL: default, "": no lock */
+  int lock_fd;
+  int lock_depth;
+  double rate;                  /* transactions per second, 0: no limit */
+  double rate_burst;
+  struct ec_bucket *bucket;
+  struct ec_rules rules;
+  int fd;
+  void *priv;
+  struct ec_stats stats;
+};
 
 void help ();
-void toggle_bluetooth ();
-void toggle_touchpad ();
-void toggle_wireless ();
-void bluetooth_on ();
-void bluetooth_off ();
-void touchpad_on ();
-void touchpad_off ();
-void wireless_on ();
-void wireless_off ();
-void show_status ();
-void dump_fields ();
-void dump_regs ();
-unsigned char get_reg (unsigned char);
-void set_reg (unsigned char, unsigned char);
-void init_port ();
-unsigned char read_port (unsigned char);
-void write_port (unsigned char, unsigned char);
+int toggle_bluetooth (struct ec_session *);
+int toggle_touchpad (struct ec_session *);
+int toggle_wireless (struct ec_session *);
+int bluetooth_on (struct ec_session *);
+int bluetooth_off (struct ec_session *);
+int touchpad_on (struct ec_session *);
+int touchpad_off (struct ec_session *);
+int wireless_on (struct ec_session *);
+int wireless_off (struct ec_session *);
+int show_status (struct ec_session *);
+int dump_fields (struct ec_session *);
+int dump_regs (struct ec_session *);
+int get_fields (struct ec_session *, const char *);
+int watch (struct ec_session *, const char *);
+int monitor (struct ec_session *, const char *);
+int monitor_gpe (void);
+long monitor_count (int);
+int ec_query (struct ec_session *);
+void rule_add (struct ec_rules *, char *);
+unsigned long rule_value (const struct ec_rule *, const unsigned char *);
+void rules_want (struct ec_session *);
+void rules_check (struct ec_session *, const unsigned char *);
+void hook_run (struct ec_session *, struct ec_rule *, unsigned long,
+               unsigned long);
+void hooks_reap (struct ec_session *);
+int batch (struct ec_session *, const char *);
+int batch_line (struct ec_session *, char *);
+const struct ec_field *batch_target (const char *, struct ec_field *);
+void watch_print (const struct ec_watch *);
+int timer_start (long long);
+void catch_signals (void);
+void on_signal (int);
+void stats_poll (struct ec_session *);
+void stats_print (struct ec_session *, int);
+void hist_add (struct ec_hist *, long long);
+long long hist_percentile (const struct ec_hist *, int);
+int get_reg (struct ec_session *, unsigned char);
+int set_reg (struct ec_session *, unsigned char, unsigned char);
+void recover (struct ec_session *);
+void lock_open (struct ec_session *);
+void ec_lock (struct ec_session *);
+void ec_unlock (struct ec_session *);
+void rate_take (struct ec_session *);
+int read_regs (struct ec_session *, const unsigned char *, int, 
+               unsigned char *);
+const struct ec_field *find_field (const char *);
+void want_field (struct ec_snapshot *, const struct ec_field *);
+unsigned long field_value (const struct ec_field *, const unsigned char *);
+long field_get (struct ec_session *, const char *);
+void field_set (struct ec_session *, const struct ec_field *, 
+                unsigned long);
+void print_field (const struct ec_field *, const unsigned char *);
+void snap_reset (struct ec_snapshot *);
+void snap_want (struct ec_snapshot *, unsigned char);
+int snap_fill (struct ec_session *);
+int snap_read (struct ec_session *);
+int snap_atomic (struct ec_session *, int);
+int static_reg (unsigned char);
+int static_fill (struct ec_session *, unsigned char *);
+void static_store (struct ec_session *, const unsigned char *);
+void static_check (struct ec_session *);
+void static_save (struct ec_session *);
+int snap_stable (struct ec_session *, const struct ec_field *);
+int snap_settle (struct ec_session *, const unsigned char *);
+int tearable (const struct ec_field *);
+void plan_update (struct ec_session *, unsigned char, unsigned char, 
+                  unsigned char);
+void plan_toggle (struct ec_session *, unsigned char, unsigned char);
+void plan_notify (struct ec_session *, unsigned char, unsigned char);
+void plan_report (struct ec_session *, const unsigned char *);
+int plan_flush (struct ec_session *);
+void snap_invalidate (struct ec_snapshot *, unsigned char);
+int burst_enable (struct ec_session *);
+void burst_disable (struct ec_session *);
+const char *ec_strerror (int);
+int report (struct ec_session *, int);
+struct ec_session *open_ec (struct ec_session *);
+void init_port (struct ec_session *);
+void close_port (struct ec_session *);
+void drop_privileges (void);
+int wait_port (struct ec_session *, unsigned char, unsigned char);
+void poll_options (struct ec_poll *, char *);
+void poll_load (struct ec_poll *);
+void poll_save (struct ec_poll *);
+int read_port (struct ec_session *, unsigned char);
+int write_port (struct ec_session *, unsigned char, unsigned char);
+const struct ec_backend *find_backend (const char *);
+int port_open (struct ec_session *);
+void port_close (struct ec_session *);
+unsigned char port_in (struct ec_session *, unsigned char);
+void port_out (struct ec_session *, unsigned char, unsigned char);
+int devport_open (struct ec_session *);
+void devport_close (struct ec_session *);
+unsigned char devport_in (struct ec_session *, unsigned char);
+void devport_out (struct ec_session *, unsigned char, unsigned char);
+int emul_open (struct ec_session *);
+void emul_close (struct ec_session *);
+unsigned char emul_in (struct ec_session *, unsigned char);
+void emul_out (struct ec_session *, unsigned char, unsigned char);
+void emul_options (char *);
+void trace_start (struct ec_session *);
+void trace_stop (struct ec_session *);
+void trace_log (struct ec_session *, int, unsigned char, unsigned char);
+void trace_flush (struct ec_tracer *);
+unsigned char trace_in (struct ec_session *, unsigned char);
+void trace_out (struct ec_session *, unsigned char, unsigned char);
+int replay_open (struct ec_session *);
+void replay_close (struct ec_session *);
+unsigned char replay_in (struct ec_session *, unsigned char);
+void replay_out (struct ec_session *, unsigned char, unsigned char);
+const struct ec_trace *replay_next (struct ec_session *);
+void replay_take (struct ec_session *, int);
+int replay_poll (const struct ec_trace *);
+int ecsys_open (struct ec_session *);
+void ecsys_close (struct ec_session *);
+int ecsys_read (struct ec_session *, const unsigned char *, int, 
+                unsigned char *);
+int ecsys_write (struct ec_session *, unsigned char, unsigned char);
+int broker_open (struct ec_session *);
+void broker_close (struct ec_session *);
+int broker_read (struct ec_session *, const unsigned char *, int, 
+                 unsigned char *);
+int broker_write (struct ec_session *, unsigned char, unsigned char);
+int broker_update (struct ec_session *, unsigned char, unsigned char,
+                   unsigned char, unsigned char);
+int broker_call (struct ec_session *, struct ec_request *, 
+                 struct ec_reply *);
+int serve (struct ec_session *);
+void serve_reply (struct pollfd *, const struct ec_reply *);
+int publish (struct ec_session *);
+int export (struct ec_session *, const char *);
+int record (struct ec_session *, const char *);
+struct ec_ring *ring_open (const char *, long, size_t *);
+struct ec_ring_block *ring_block (struct ec_ring *, uint32_t);
+int decode (const char *);
+int decode_block (const struct ec_ring_block *, size_t, long long, 
+                  long long);
+unsigned char *varint_put (unsigned char *, uint32_t);
+const unsigned char *varint_get (const unsigned char *, 
+                                 const unsigned char *, uint32_t *);
+int export_write (struct ec_session *, const char *);
+void export_print (FILE *, const unsigned char *);
+void shm_publish (struct ec_shm *, const struct ec_snapshot *);
+void shm_snapshot (const struct ec_shm *, struct ec_shm *);
+int shm_open_reader (struct ec_session *);
+void shm_close_reader (struct ec_session *);
+int shm_read_regs (struct ec_session *, const unsigned char *, int, 
+                   unsigned char *);
+int shm_write_reg (struct ec_session *, unsigned char, unsigned char);
+void emul_tick (struct ec_emul *);
+void emul_reply (struct ec_emul *, unsigned char);
+long long monotonic_ns (void);
+void cpu_relax (void);
+void bench (struct ec_session *, int);
+void bench_run (struct ec_session *, const char *, 
+                int (*) (struct ec_session *), int);
+void bench_stress (struct ec_session *, int, int);
+int stand_in_open (struct ec_session *);
+void stand_in_close (struct ec_session *);
+unsigned char stand_in_in (struct ec_session *, unsigned char);
+void stand_in_out (struct ec_session *, unsigned char, unsigned char);
+
+static const struct ec_backend backends[] =
+  {
+    {"port", port_open, port_close, port_in, port_out, NULL, NULL, NULL},
+    {"devport", devport_open, devport_close, devport_in, devport_out, 
+     NULL, NULL, NULL},
+    {"emul", emul_open, emul_close, emul_in, emul_out, NULL, NULL, NULL},
+    {"replay", replay_open, replay_close, replay_in, replay_out, 
+     NULL, NULL, NULL},
+    {"ecsys", ecsys_open, ecsys_close, NULL, NULL, ecsys_read, ecsys_write,
+     NULL},
+    {"broker", broker_open, broker_close, NULL, NULL, 
+     broker_read, broker_write, broker_update},
+    {"shm", shm_open_reader, shm_close_reader, NULL, NULL, 
+     shm_read_regs, shm_write_reg, NULL},
+    {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+  };
+
+/* Register map, in dump order */
+static const struct ec_field fields[] =
+  {
+    {"BATM", 0x08, 2, 0xff, 0, F_HEX | F_STATIC},
+    {"BATD", 0x19, 7, 0xff, 0, F_HEX | F_STATIC},
+    /* SMB Protocol */
+    {"SMPR", 0x60, 1, 0xff, 0, F_HEX},
+    /* SMB Status */
+    {"SMST", 0x61, 1, 0xff, 0, F_HEX},
+    /* SMB Address */
+    {"SMAD", 0x62, 1, 0xff, 0, F_HEX},
+    /* SMB Command */
+    {"SMCM", 0x63, 1, 0xff, 0, F_HEX},
+    /* SMB Data */
+    {"SMDR", 0x64, 4, 0xff, 0, F_HEX},
+    /* SMB Block Count */
+    {"BCNT", 0x68, 1, 0xff, 0, F_HEX},
+    /* SMB Alarm Address */
+    {"SMAA", 0x69, 1, 0xff, 0, F_HEX},
+    /* SMB Alarm Data 0 */
+    {"SMD0", 0x6a, 1, 0xff, 0, F_HEX},
+    /* SMB Alarm Data 1 */
+    {"SMD1", 0x6b, 1, 0xff, 0, F_HEX},
+    {"ERIB", 0x94, 2, 0xff, 0, F_HEX},
+    {"ERBD", 0x96, 1, 0xff, 0, F_HEX},
+    {"OSIF", 0x99, 1, 0x01, 0, 0},
+    {"BAL1", 0x9a, 1, 0x01, 0, 0},
+    {"BAL2", 0x9a, 1, 0x02, 1, 0},
+    {"BAL3", 0x9a, 1, 0x04, 2, 0},
+    {"BAL4", 0x9a, 1, 0x08, 3, 0},
+    {"BCL1", 0x9a, 1, 0x10, 4, 0},
+    {"BCL2", 0x9a, 1, 0x20, 5, 0},
+    {"BCL3", 0x9a, 1, 0x40, 6, 0},
+    {"BCL4", 0x9a, 1, 0x80, 7, 0},
+    {"BPU1", 0x9b, 1, 0x01, 0, 0},
+    {"BPU2", 0x9b, 1, 0x02, 1, 0},
+    {"BPU3", 0x9b, 1, 0x04, 2, 0},
+    {"BPU4", 0x9b, 1, 0x08, 3, 0},
+    {"BOS1", 0x9b, 1, 0x10, 4, 0},
+    {"BOS2", 0x9b, 1, 0x20, 5, 0},
+    {"BOS3", 0x9b, 1, 0x40, 6, 0},
+    {"BOS4", 0x9b, 1, 0x80, 7, 0},
+    {"PHDD", 0x9c, 1, 0x01, 0, 0},
+    {"IFDD", 0x9c, 1, 0x02, 1, 0},
+    {"IODD", 0x9c, 1, 0x04, 2, 0},
+    {"SHDD", 0x9c, 1, 0x08, 3, 0},
+    {"LS20", 0x9c, 1, 0x10, 4, 0},
+    {"EFDD", 0x9c, 1, 0x20, 5, 0},
+    {"ECRT", 0x9c, 1, 0x40, 6, 0},
+    {"LANC", 0x9c, 1, 0x80, 7, 0},
+    {"SBTN", 0x9d, 1, 0x01, 0, 0},
+    {"VIDO", 0x9d, 1, 0x02, 1, 0},
+    {"VOLD", 0x9d, 1, 0x04, 2, 0},
+    {"VOLU", 0x9d, 1, 0x08, 3, 0},
+    {"MUTE", 0x9d, 1, 0x10, 4, 0},
+    {"CONT", 0x9d, 1, 0x20, 5, 0},
+    {"BRGT", 0x9d, 1, 0x40, 6, 0},
+    {"HBTN", 0x9d, 1, 0x80, 7, 0},
+    {"S4SE", 0x9e, 1, 0x01, 0, 0},
+    {"SKEY", 0x9e, 1, 0x02, 1, 0},
+    {"BKEY", 0x9e, 1, 0x04, 2, 0},
+    {"TKEY", 0x9e, 1, 0x08, 3, 0},
+    {"FKEY", 0x9e, 1, 0x10, 4, 0},
+    {"DVDM", 0x9e, 1, 0x20, 5, 0},
+    {"DIGM", 0x9e, 1, 0x40, 6, 0},
+    {"CDLK", 0x9e, 1, 0x80, 7, 0},
+    /* Lid Switch */
+    {"LIDO", 0x9f, 1, 0x02, 1, 0},
+    {"PMEE", 0x9f, 1, 0x04, 2, 0},
+    {"PBET", 0x9f, 1, 0x08, 3, 0},
+    {"RIIN", 0x9f, 1, 0x10, 4, 0},
+    {"BTWK", 0x9f, 1, 0x20, 5, 0},
+    {"DKIN", 0x9f, 1, 0x40, 6, 0},
+    {"SWTH", 0xa0, 1, 0x40, 6, 0},
+    {"HWTH", 0xa0, 1, 0x80, 7, 0},
+    {"DTK0", 0xa1, 1, 0x01, 0, 0},
+    {"DTK1", 0xa1, 1, 0x02, 1, 0},
+    {"OSUD", 0xa1, 1, 0x10, 4, 0},
+    {"OSDK", 0xa1, 1, 0x20, 5, 0},
+    {"OSSU", 0xa1, 1, 0x40, 6, 0},
+    {"DKCG", 0xa1, 1, 0x80, 7, 0},
+    {"ODTS", 0xa2, 1, 0xff, 0, 0},
+    {"S1LD", 0xa3, 1, 0x01, 0, 0},
+    {"S3LD", 0xa3, 1, 0x02, 1, 0},
+    {"VGAQ", 0xa3, 1, 0x04, 2, 0},
+    {"PCMQ", 0xa3, 1, 0x08, 3, 0},
+    {"PCMR", 0xa3, 1, 0x10, 4, 0},
+    /* Adapter Preset */
+    {"ADPT", 0xa3, 1, 0x20, 5, 0},
+    {"SYS6", 0xa3, 1, 0x40, 6, 0},
+    {"SYS7", 0xa3, 1, 0x80, 7, 0},
+    {"PWAK", 0xa4, 1, 0x01, 0, 0},
+    {"MWAK", 0xa4, 1, 0x02, 1, 0},
+    {"LWAK", 0xa4, 1, 0x04, 2, 0},
+    {"RWAK", 0xa4, 1, 0x08, 3, 0},
+    {"KWAK", 0xa4, 1, 0x40, 6, 0},
+    {"MSWK", 0xa4, 1, 0x80, 7, 0},
+    {"CCAC", 0xa5, 1, 0x01, 0, 0},
+    {"AOAC", 0xa5, 1, 0x02, 1, 0},
+    {"BLAC", 0xa5, 1, 0x04, 2, 0},
+    {"PSRC", 0xa5, 1, 0x08, 3, 0},
+    {"BOAC", 0xa5, 1, 0x10, 4, 0},
+    {"LCAC", 0xa5, 1, 0x20, 5, 0},
+    {"AAAC", 0xa5, 1, 0x40, 6, 0},
+    {"ACAC", 0xa5, 1, 0x80, 7, 0},
+    {"PCEC", 0xa6, 1, 0xff, 0, 0},
+    /* Passive Trip Point Temp. */
+    {"THON", 0xa7, 1, 0xff, 0, 0},
+    /* Critical Trip Point Temp. */
+    {"THSD", 0xa8, 1, 0xff, 0, 0},
+    {"THEM", 0xa9, 1, 0xff, 0, 0},
+    {"TCON", 0xaa, 1, 0xff, 0, 0},
+    {"THRS", 0xab, 1, 0xff, 0, 0},
+    {"TSSE", 0xac, 1, 0xff, 0, 0},
+    {"FSSN", 0xad, 1, 0x0f, 0, 0},
+    {"FANU", 0xad, 1, 0xf0, 4, 0},
+    {"PTVL", 0xae, 1, 0x07, 0, 0},
+    {"TTSR", 0xae, 1, 0x40, 6, 0},
+    {"TTHR", 0xae, 1, 0x80, 7, 0},
+    {"TSTH", 0xaf, 1, 0x01, 0, 0},
+    {"TSBC", 0xaf, 1, 0x02, 1, 0},
+    {"TSBF", 0xaf, 1, 0x04, 2, 0},
+    {"TSPL", 0xaf, 1, 0x08, 3, 0},
+    {"TSBT", 0xaf, 1, 0x10, 4, 0},
+    {"THTA", 0xaf, 1, 0x80, 7, 0},
+    /* CPU Temp */
+    {"CTMP", 0xb0, 1, 0xff, 0, 0},
+    {"LTMP", 0xb1, 1, 0xff, 0, 0},
+    {"SKTA", 0xb2, 1, 0xff, 0, 0},
+    {"SKTB", 0xb3, 1, 0xff, 0, 0},
+    {"SKTC", 0xb4, 1, 0xff, 0, 0},
+    {"SKTD", 0xb5, 1, 0xff, 0, 0},
+    {"NBTP", 0xb6, 1, 0xff, 0, 0},
+    {"LANP", 0xb7, 1, 0x01, 0, 0},
+    {"LCDS", 0xb7, 1, 0x02, 1, 0},
+    {"BTPV", 0xb8, 1, 0xff, 0, 0},
+    /* Brightness */
+    {"BRTS", 0xb9, 1, 0xff, 0, 0},
+    {"CRTS", 0xba, 1, 0xff, 0, 0},
+    /* WLAN Active */
+    {"WLAT", 0xbb, 1, 0x01, 0, 0},
+    /* Bluetooth Active */
+    {"BTAT", 0xbb, 1, 0x02, 1, 0},
+    /* WLAN Adapter Present */
+    {"WLEX", 0xbb, 1, 0x04, 2, 0},
+    /* Bluetooth Adapter Present */
+    {"BTEX", 0xbb, 1, 0x08, 3, 0},
+    {"KLSW", 0xbb, 1, 0x10, 4, 0},
+    {"WLOK", 0xbb, 1, 0x20, 5, 0},
+    /* 3G Active */
+    {"W3GA", 0xbb, 1, 0x40, 6, 0},
+    /* 3G Adapter Present */
+    {"W3GE", 0xbb, 1, 0x80, 7, 0},
+    {"PJID", 0xbc, 1, 0xff, 0, F_STATIC},
+    {"CPUN", 0xbd, 1, 0xff, 0, F_STATIC},
+    {"THFN", 0xbe, 1, 0xff, 0, 0},
+    {"MLED", 0xbf, 1, 0x01, 0, 0},
+    {"SCHG", 0xbf, 1, 0x02, 1, 0},
+    {"SCCF", 0xbf, 1, 0x04, 2, 0},
+    {"SCPF", 0xbf, 1, 0x08, 3, 0},
+    {"ACIS", 0xbf, 1, 0x10, 4, 0},
+    /* Battery Manufacturer */
+    {"BTMF", 0xc0, 1, 0x70, 4, F_STATIC},
+    {"BTY0", 0xc0, 1, 0x80, 7, F_STATIC},
+    /* Battery Status */
+    {"BST0", 0xc1, 1, 0xff, 0, 0},
+    /* Battery Remain Capacity (mAh) */
+    {"BRC0", 0xc2, 2, 0xff, 0, F_HEX},
+    {"BSN0", 0xc4, 2, 0xff, 0, F_HEX | F_STATIC},
+    /* Battery Present Voltage (mV) */
+    {"BPV0", 0xc6, 2, 0xff, 0, F_HEX},
+    /* Battery Design Voltage (mV) */
+    {"BDV0", 0xc8, 2, 0xff, 0, F_HEX | F_STATIC},
+    /* Battery Design Capacity (mAh) */
+    {"BDC0", 0xca, 2, 0xff, 0, F_HEX | F_STATIC},
+    /* Battery Full Charge (mAh) */
+    {"BFC0", 0xcc, 2, 0xff, 0, F_HEX},
+    /* Battery Guage (%) */
+    {"GAU0", 0xce, 1, 0xff, 0, 0},
+    {"BSCY", 0xcf, 1, 0xff, 0, 0},
+    {"BSCU", 0xd0, 2, 0xff, 0, F_HEX},
+    {"BAC0", 0xd2, 2, 0xff, 0, F_HEX},
+    {"BTW0", 0xd4, 1, 0xff, 0, 0},
+    {"BATV", 0xd5, 1, 0xff, 0, 0},
+    {"BPTC", 0xd6, 1, 0xff, 0, 0},
+    {"BTTC", 0xd7, 1, 0xff, 0, 0},
+    {"BTMA", 0xd8, 2, 0xff, 0, F_HEX},
+    {"BTSC", 0xda, 1, 0xff, 0, 0},
+    {"BCIX", 0xdb, 1, 0xff, 0, 0},
+    {"CCBA", 0xdc, 1, 0xff, 0, 0},
+    {"CBOT", 0xdd, 1, 0xff, 0, 0},
+    {"BTSS", 0xde, 2, 0xff, 0, F_HEX},
+    {"OVCC", 0xe0, 1, 0xff, 0, 0},
+    {"CCFC", 0xe1, 1, 0xff, 0, 0},
+    {"BADC", 0xe2, 1, 0xff, 0, 0},
+    {"BSC1", 0xe3, 2, 0xff, 0, F_HEX},
+    {"BSC2", 0xe5, 2, 0xff, 0, F_HEX},
+    {"BSC3", 0xe7, 2, 0xff, 0, F_HEX},
+    {"BSE4", 0xe9, 2, 0xff, 0, F_HEX},
+    {"BDME", 0xeb, 2, 0xff, 0, F_HEX},
+    {"BTS1", 0xf0, 1, 0xff, 0, 0},
+    {"BTS2", 0xf1, 1, 0xff, 0, 0},
+    {"BSCS", 0xf2, 2, 0xff, 0, F_HEX},
+    {"BDAD", 0xf4, 2, 0xff, 0, F_HEX | F_STATIC},
+    {"BACV", 0xf6, 2, 0xff, 0, F_HEX},
+    {"BDFC", 0xf8, 2, 0xff, 0, F_HEX},
+    {NULL, 0, 0, 0, 0, 0}
+  };
+
+/* Fields decoded by show_status, default for --watch */
+static const char *status_fields[] =
+  { "WLAT", "BTAT", "TKEY", "BRTS", "CTMP", "LIDO", "ADPT", "BST0", 
+    "BRC0", "GAU0", "BPV0", NULL };
+
+/* Fields changed by EC events, re-read by --monitor */
+static const char *event_fields[] =
+  { "LIDO", "ADPT", "BST0", "WLAT", "BTAT", "TKEY", "BRTS", NULL };
+
+/* --record channels */
+static const char *record_fields[RING_CHANNELS] =
+  { "BRC0", "BPV0", "BAC0", "GAU0", "BST0" };
+
+/* --export=prometheus, samples of one metric kept together */
+static const struct ec_metric metrics[] =
+  {
+    {"acer_ec_temperature_celsius", "EC temperature sensors", 
+     "sensor=\"cpu\"", "CTMP", 0, 1},
+    {"acer_ec_temperature_celsius", NULL, "sensor=\"local\"", "LTMP", 0, 1},
+    {"acer_ec_temperature_celsius", NULL, "sensor=\"skta\"", "SKTA", 0, 1},
+    {"acer_ec_temperature_celsius", NULL, "sensor=\"sktb\"", "SKTB", 0, 1},
+    {"acer_ec_temperature_celsius", NULL, "sensor=\"sktc\"", "SKTC", 0, 1},
+    {"acer_ec_temperature_celsius", NULL, "sensor=\"sktd\"", "SKTD", 0, 1},
+    {"acer_ec_fan_level", "Fan speed step", NULL, "FSSN", 0, 1},
+    {"acer_ec_battery_charge_ratio", "Battery gauge", NULL, "GAU0", 0, 0.01},
+    {"acer_ec_battery_remaining_ampere_hours", "Battery remaining capacity",
+     NULL, "BRC0", 0, 0.001},
+    {"acer_ec_battery_full_ampere_hours", "Battery last full capacity", 
+     NULL, "BFC0", 0, 0.001},
+    {"acer_ec_battery_design_ampere_hours", "Battery design capacity", 
+     NULL, "BDC0", 0, 0.001},
+    {"acer_ec_battery_voltage_volts", "Battery present voltage", 
+     NULL, "BPV0", 0, 0.001},
+    {"acer_ec_battery_state", "Battery status flags", 
+     "state=\"discharging\"", "BST0", 0x01, 1},
+    {"acer_ec_battery_state", NULL, "state=\"charging\"", "BST0", 0x02, 1},
+    {"acer_ec_battery_state", NULL, "state=\"critical\"", "BST0", 0x04, 1},
+    {"acer_ec_ac_online", "Power adapter present", NULL, "ADPT", 0, 1},
+    {"acer_ec_lid_open", "Lid switch", NULL, "LIDO", 0, 1},
+    {"acer_ec_radio_enabled", "Radio switches", 
+     "radio=\"wireless\"", "WLAT", 0, 1},
+    {"acer_ec_radio_enabled", NULL, "radio=\"bluetooth\"", "BTAT", 0, 1},
+    {"acer_ec_touchpad_disabled", "Touchpad switch", NULL, "TKEY", 0, 1},
+    {"acer_ec_backlight_level", "Backlight level (0 - 9)", 
+     NULL, "BRTS", 0, 1},
+    {NULL, NULL, NULL, NULL, 0, 0}
+  };
+
+static const struct ec_switch switches[] =
+  {
+    {"bluetooth", "Bluetooth", 0xbb, 0x02, 0, 
+     bluetooth_on, bluetooth_off, toggle_bluetooth},
+    {"touchpad", "Touchpad", 0x9e, 0x08, 1, 
+     touchpad_on, touchpad_off, toggle_touchpad},
+    {"wireless", "Wireless", 0xbb, 0x01, 0, 
+     wireless_on, wireless_off, toggle_wireless},
+    {NULL, NULL, 0, 0, 0, NULL, NULL, NULL}
+  };
+
+static const struct ec_poll default_poll =
+  { POLL_SPIN, POLL_SLEEP_MIN, POLL_SLEEP_MAX, 0, 1, NULL };
 
 int quiet = 0;
+long interval = 1000;           /* ms */
+volatile sig_atomic_t interrupted = 0;
+volatile sig_atomic_t stats_requested = 0;
+struct ec_emul emul;
 
 int
 main (int argc, char *argv[])
 {
-  int opt;
+  int opt, err;
   int status = EXIT_SUCCESS;
+  char *end;
+  struct ec_session ec;
+  const char *shortopts = "b::dg:hl:qrst::vw::";
 
   static struct option longopts[] = 
     {
       {"bluetooth", optional_argument, NULL, 'b'},
+      {"cache-ttl", required_argument, NULL, OPT_CACHE_TTL},
+      {"decode",    required_argument, NULL, OPT_DECODE},
+      {"devport",   required_argument, NULL, OPT_DEVPORT},
+      {"drop-privileges", no_argument, NULL, OPT_DROP_PRIVILEGES},
       {"dump",      no_argument,       NULL, 'd'},
       {"help",      no_argument,       NULL, 'h'},
+      {"interval",  required_argument, NULL, OPT_INTERVAL},
+      {"lock",      required_argument, NULL, OPT_LOCK},
+      {"monitor",   optional_argument, NULL, OPT_MONITOR},
+      {"backend",   required_argument, NULL, OPT_BACKEND},
       {"backlight", required_argument, NULL, 'l'},
+      {"batch",     required_argument, NULL, OPT_BATCH},
+      {"bench",     optional_argument, NULL, OPT_BENCH},
+      {"ecsys",     required_argument, NULL, OPT_ECSYS},
+      {"emul",      required_argument, NULL, OPT_EMUL},
+      {"export",    required_argument, NULL, OPT_EXPORT},
+      {"from-shm",  optional_argument, NULL, OPT_FROM_SHM},
+      {"no-burst",  no_argument,       NULL, OPT_NO_BURST},
+      {"on",        required_argument, NULL, OPT_ON},
+      {"poll",      required_argument, NULL, OPT_POLL},
+      {"publish",   optional_argument, NULL, OPT_PUBLISH},
       {"quiet",     no_argument,       NULL, 'q'},
+      {"rate",      required_argument, NULL, OPT_RATE},
+      {"record",    required_argument, NULL, OPT_RECORD},
+      {"refresh",   no_argument,       NULL, OPT_REFRESH},
       {"registers", no_argument,       NULL, 'r'},
+      {"replay",    required_argument, NULL, OPT_REPLAY},
+      {"retries",   required_argument, NULL, OPT_RETRIES},
+      {"serve",     no_argument,       NULL, OPT_SERVE},
+      {"socket",    required_argument, NULL, OPT_SOCKET},
+      {"static-cache", required_argument, NULL, OPT_STATIC_CACHE},
+      {"stats",     optional_argument, NULL, OPT_STATS},
       {"status",    no_argument,       NULL, 's'},
+      {"timeout",   required_argument, NULL, OPT_TIMEOUT},
       {"touchpad",  optional_argument, NULL, 't'},
+      {"trace",     required_argument, NULL, OPT_TRACE},
+      {"verify",    no_argument,       NULL, OPT_VERIFY},
       {"version",   no_argument,       NULL, 'v'},
+      {"watch",     optional_argument, NULL, OPT_WATCH},
       {"wireless",  optional_argument, NULL, 'w'},
       {0, 0, 0, 0}
     };
 
+  memset (&ec, 0, sizeof (ec));
+  ec.backend = &backends[0];
+  ec.auto_backend = 1;
+  ec.socket = BROKER_SOCKET;
+  ec.cache_ttl = BROKER_TTL * 1000000L;
+  ec.shm_name = SHM_NAME;
+  ec.ecsys_path = ECSYS_PATH;
+  ec.devport_path = DEVPORT_PATH;
+  ec.fd = -1;
+  ec.lock_fd = -1;
+  ec.poll = default_poll;
+  ec.timeout = EC_TIMEOUT;
+  ec.retries = EC_RETRIES;
+
+  /* an ec_sys file without write_support only does for reads */
+  opterr = 0;
+  while ((opt = getopt_long (argc, argv, shortopts, longopts, 0)) != -1)
+    if (opt == 'b' || opt == 'l' || opt == 't' || opt == 'w' 
+        || opt == OPT_BATCH)
+      ec.writes = 1;
+  opterr = 1;
+  optind = 0;
+
   if (argc == 1)
-    show_status ();
+    status = report (&ec, show_status (open_ec (&ec)));
 
-  while ((opt = getopt_long (argc, argv, "b::dg:hl:qrst::vw::", longopts, 0)) != -1)
+  while ((opt = getopt_long (argc, argv, shortopts, longopts, 0)) != -1)
     {
+      err = 0;
       switch (opt)
         {
         case 'b':               /* bluetooth */
           if (optarg)
             {
-              if (strncasecmp (optarg, "off") == 0)
-                bluetooth_off ();
-              else if (strncasecmp (optarg, "on") == 0)
-                bluetooth_on ();
+              if (strcasecmp (optarg, "off") == 0)
+                err = bluetooth_off (open_ec (&ec));
+              else if (strcasecmp (optarg, "on") == 0)
+                err = bluetooth_on (open_ec (&ec));
             }
           else 
-            toggle_bluetooth ();
+            err = toggle_bluetooth (open_ec (&ec));
           break;
         case 'd':               /* dump fields */
-          dump_fields ();
+          err = dump_fields (open_ec (&ec));
           break;
-        case 'g':               /* get register value */
-          printf ("%d\n", get_reg (atoi (optarg) % 256));
+        case 'g':               /* get fields / registers */
+          err = get_fields (open_ec (&ec), optarg);
           break;
         case 'l':               /* backlight */
-          set_reg (0xb9, atoi (optarg) % 10);
+          plan_update (open_ec (&ec), 0xb9, 0xff, atoi (optarg) % 10);
           break;
         case 'q':
           quiet = 1;
@@ -134,30 +1191,162 @@ main (int argc, char *argv[])
         case 't':               /* touchpad */
            if (optarg)
             {
-              if (strncasecmp (optarg, "off") == 0)
-                touchpad_off ();
-              else if (strncasecmp (optarg, "on") == 0)
-                touchpad_on ();
+              if (strcasecmp (optarg, "off") == 0)
+                err = touchpad_off (open_ec (&ec));
+              else if (strcasecmp (optarg, "on") == 0)
+                err = touchpad_on (open_ec (&ec));
             }
           else 
-            toggle_touchpad ();
+            err = toggle_touchpad (open_ec (&ec));
           break;
         case 'w':               /* wireless */
            if (optarg)
             {
-              if (strncasecmp (optarg, "off") == 0)
-                wireless_off ();
-              else if (strncasecmp (optarg, "on") == 0)
-                wireless_on ();
+              if (strcasecmp (optarg, "off") == 0)
+                err = wireless_off (open_ec (&ec));
+              else if (strcasecmp (optarg, "on") == 0)
+                err = wireless_on (open_ec (&ec));
             }
           else 
-            toggle_wireless ();
+            err = toggle_wireless (open_ec (&ec));
           break;
         case 'r':               /* dump registers */
-          dump_regs ();
+          err = dump_regs (open_ec (&ec));
           break;
         case 's':               /* show status */
-          show_status ();
+          err = show_status (open_ec (&ec));
+          break;
+        case OPT_INTERVAL:      /* sampling interval (ms) */
+          interval = atol (optarg);
+          if (interval <= 0)
+            interval = 1000;
+          break;
+        case OPT_BATCH:         /* command stream */
+          if (batch (open_ec (&ec), optarg) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+          break;
+        case OPT_WATCH:         /* watch fields */
+          err = watch (open_ec (&ec), optarg);
+          break;
+        case OPT_MONITOR:       /* event driven watch */
+          err = monitor (open_ec (&ec), optarg);
+          break;
+        case OPT_BACKEND:       /* port I/O backend */
+          ec.backend = find_backend (optarg);
+          if (ec.backend == NULL)
+            {
+              fprintf (stderr, "Unknown backend: %s\n", optarg);
+              exit (EXIT_FAILURE);
+            }
+          ec.auto_backend = 0;
+          break;
+        case OPT_SERVE:         /* EC broker */
+          ec.auto_backend = 0;
+          err = serve (open_ec (&ec));
+          break;
+        case OPT_PUBLISH:       /* shared memory sampler */
+          if (optarg)
+            ec.shm_name = optarg;
+          ec.auto_backend = 0;
+          err = publish (open_ec (&ec));
+          break;
+        case OPT_EXPORT:        /* metrics for node_exporter */
+          err = export (open_ec (&ec), optarg);
+          break;
+        case OPT_RECORD:        /* battery telemetry */
+          err = record (open_ec (&ec), optarg);
+          break;
+        case OPT_DECODE:        /* recording to CSV */
+          if (decode (optarg) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+          break;
+        case OPT_FROM_SHM:      /* read the published snapshot */
+          if (optarg)
+            ec.shm_name = optarg;
+          ec.backend = find_backend ("shm");
+          ec.auto_backend = 0;
+          break;
+        case OPT_LOCK:          /* inter-process lock file */
+          ec.lock_path = optarg;
+          break;
+        case OPT_RATE:          /* TPS[:BURST] */
+          ec.rate = strtod (optarg, &end);
+          ec.rate_burst = *end == ':' ? strtod (end + 1, &end) : 0;
+          if (ec.rate <= 0 || ec.rate_burst < 0 || *end != '\0')
+            {
+              fprintf (stderr, "Invalid rate: %s\n", optarg);
+              exit (EXIT_FAILURE);
+            }
+          if (ec.rate_burst < 1)
+            ec.rate_burst = 1 + ec.rate / 10;
+          break;
+        case OPT_STATIC_CACHE:  /* cache of static fields */
+          ec.static_path = optarg;
+          break;
+        case OPT_REFRESH:
+          ec.refresh = 1;
+          break;
+        case OPT_TRACE:         /* record port operations */
+          ec.trace_path = optarg;
+          break;
+        case OPT_REPLAY:        /* run against a recorded trace */
+          ec.replay_path = optarg;
+          ec.backend = find_backend ("replay");
+          ec.auto_backend = 0;
+          break;
+        case OPT_DEVPORT:       /* /dev/port stand-in */
+          ec.devport_path = optarg;
+          break;
+        case OPT_ECSYS:         /* ec_sys node */
+          ec.ecsys_path = optarg;
+          break;
+        case OPT_SOCKET:
+          ec.socket = optarg;
+          break;
+        case OPT_CACHE_TTL:
+          ec.cache_ttl = atol (optarg) * 1000000L;
+          break;
+        case OPT_DROP_PRIVILEGES:
+          ec.drop_privileges = 1;
+          break;
+        case OPT_NO_BURST:
+          ec.no_burst = 1;
+          break;
+        case OPT_ON:            /* hook for --watch, --monitor */
+          rule_add (&ec.rules, optarg);
+          break;
+        case OPT_VERIFY:
+          ec.verify = 1;
+          break;
+        case OPT_STATS:         /* statistics at exit */
+          if (optarg == NULL || strcasecmp (optarg, "text") == 0)
+            ec.stats_format = STATS_TEXT;
+          else if (strcasecmp (optarg, "json") == 0)
+            ec.stats_format = STATS_JSON;
+          else
+            {
+              fprintf (stderr, "Unknown statistics format: %s\n", optarg);
+              exit (EXIT_FAILURE);
+            }
+          break;
+        case OPT_POLL:
+          poll_options (&ec.poll, optarg);
+          break;
+        case OPT_TIMEOUT:       /* per transaction deadline (ms) */
+          ec.timeout = atol (optarg) * 1000000L;
+          if (ec.timeout <= 0)
+            ec.timeout = EC_TIMEOUT;
+          break;
+        case OPT_RETRIES:
+          ec.retries = atoi (optarg);
+          if (ec.retries < 0)
+            ec.retries = 0;
+          break;
+        case OPT_BENCH:         /* benchmark */
+          bench (open_ec (&ec), optarg ? atoi (optarg) : 10);
+          break;
+        case OPT_EMUL:          /* emulator options */
+          emul_options (optarg);
           break;
         case 'v':               /* version */
           printf ("%s %s\n", argv[0], VERSION);
@@ -167,8 +1356,17 @@ main (int argc, char *argv[])
           help (argv[0]);
           break;
         }
+
+      if (report (&ec, err) != EXIT_SUCCESS)
+        status = EXIT_FAILURE;
     }
 
+  if (ec.opened && report (&ec, plan_flush (&ec)) != EXIT_SUCCESS)
+    status = EXIT_FAILURE;
+  if (ec.opened && ec.stats_format)
+    stats_print (&ec, ec.stats_format);
+  close_port (&ec);
+
   return status;
 }
 
@@ -185,126 +1383,168 @@ help (char *progname)
   printf ("      --wireless={on | off}  set wireless on / off\n");
   printf ("  -l, --backlight n          set backlight to n (0 - 9)\n");
   printf ("  -q, --quiet                quiet mode (specify before -b, -t, -w)\n");
-  printf ("  -g r                       get register value (0 - 255)\n");
+  printf ("  -g list                    get fields or registers, e.g. CTMP,0xc2-0xc3\n");
   printf ("  -d, --dump                 dump known fields\n");
   printf ("  -r, --registers            dump registers\n");
   printf ("  -s, --status               show status\n");
+  printf ("      --watch[=f[@ms],...]   print fields whenever they change\n");
+  printf ("      --interval=ms          sampling interval (default 1000)\n");
+  printf ("      --monitor[=query|acpi] print lid, adapter, battery... changes as\n");
+  printf ("                             the EC signals them\n");
+  printf ("      --on=field[&mask][cond]:{command | |fifo}\n");
+  printf ("                             run a command or write to a FIFO in\n");
+  printf ("                             --watch or --monitor; cond: .change,\n");
+  printf ("                             .rise, .fall, >n[/m], <n[/m]\n");
+  printf ("      --batch={file | -}     run commands from file, one per line\n");
+  printf ("      --serve                serve EC access to other acer-ec processes\n");
+  printf ("      --socket=path          broker socket (default %s)\n", 
+          BROKER_SOCKET);
+  printf ("      --cache-ttl=ms         broker cache lifetime (default %d)\n", 
+          BROKER_TTL);
+  printf ("      --publish[=name]       publish snapshots in shared memory\n");
+  printf ("      --from-shm[=name]      read the published snapshot\n");
+  printf ("      --record=file[:kb]     record battery telemetry each interval\n");
+  printf ("                             to a ring file (default %d kb)\n", 
+          RING_SIZE);
+  printf ("      --decode=file[:from-to]\n");
+  printf ("                             print a recording as CSV, optionally\n");
+  printf ("                             from and to a time (UNIX seconds)\n");
+  printf ("      --export=prometheus[:file]\n");
+  printf ("                             write metrics, to file each interval\n");
+  printf ("      --backend=NAME         port I/O backend (port, devport, ecsys, emul,\n");
+  printf ("                             replay, broker, shm)\n");
+  printf ("      --devport=path         port device (default %s)\n",
+          DEVPORT_PATH);
+  printf ("      --ecsys=path           ec_sys node (default %s)\n",
+          ECSYS_PATH);
+  printf ("      --emul=opt[,opt]       emulator: latency=ns, burst=ns, noburst,\n");
+  printf ("                             drop=n, churn=n, event=ms\n");
+  printf ("      --no-burst             do not use EC burst mode\n");
+  printf ("      --poll=opt[,opt]       status polling: spin=us, sleep=us, max=us,\n");
+  printf ("                             file=path, fixed\n");
+  printf ("      --lock=path            lock file serializing EC access (default\n");
+  printf ("                             %s)\n", LOCK_PATH);
+  printf ("      --rate=tps[:burst]     limit EC transactions per second, shared\n");
+  printf ("                             by all processes using the lock file\n");
+  printf ("      --timeout=ms           deadline per transaction (default 100)\n");
+  printf ("      --retries=n            retries per transaction (default 2)\n");
+  printf ("      --static-cache=path    cache of static fields (default %s)\n",
+          STATIC_CACHE);
+  printf ("      --refresh              read static fields from the EC again\n");
+  printf ("      --trace=file           append every port operation to file\n");
+  printf ("      --replay=file          replay a trace instead of using the EC\n");
+  printf ("      --verify               read back registers after writing\n");
+  printf ("      --stats[=json]         print statistics to stderr at exit\n");
+  printf ("      --drop-privileges      drop root after opening the EC\n");
+  printf ("      --bench[=n]            benchmark commands, n runs each\n");
   printf ("  -v, --version              show version\n");
   printf ("  -h, -?, --help             print this help\n");
   printf ("\n");
   printf ("Report bugs to kitty@kitty.in.th\n");
 }
 
-void
-toggle_bluetooth ()
+int
+toggle_bluetooth (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  if (r & 0x02)
-    bluetooth_off ();
-  else
-    bluetooth_on ();
+  plan_toggle (ec, 0xbb, 0x02);
+  plan_notify (ec, 0xbb, 0x02);
+  return 0;
 }
 
-void
-toggle_touchpad ()
+int
+toggle_touchpad (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0x9e);
-  if (r & 0x08)
-    touchpad_on ();
-  else
-    touchpad_off ();
+  plan_toggle (ec, 0x9e, 0x08);
+  plan_notify (ec, 0x9e, 0x08);
+  return 0;
 }
 
-void
-toggle_wireless ()
+int
+toggle_wireless (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  if (r & 0x01)
-    wireless_off ();
-  else
-    wireless_on ();
+  plan_toggle (ec, 0xbb, 0x01);
+  plan_notify (ec, 0xbb, 0x01);
+  return 0;
 }
 
-void
-bluetooth_off (void)
+int
+bluetooth_off (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  set_reg (0xbb, r & 0xfd);
-  if (!quiet)
-    printf ("Bluetooth is now off.\n");
+  plan_update (ec, 0xbb, 0x02, 0);
+  plan_notify (ec, 0xbb, 0x02);
+  return 0;
 }
 
-void
-bluetooth_on (void)
+int
+bluetooth_on (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  set_reg (0xbb, r | 0x02);
-  if (!quiet)
-    printf ("Bluetooth is now on.\n");
+  plan_update (ec, 0xbb, 0, 0x02);
+  plan_notify (ec, 0xbb, 0x02);
+  return 0;
 } 
 
-void
-touchpad_off (void)
+int
+touchpad_off (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0x9e);
-  set_reg (0x9e, r | 0x08);
-  if (!quiet)
-    printf ("Touchpad is now off.\n");
+  plan_update (ec, 0x9e, 0, 0x08);
+  plan_notify (ec, 0x9e, 0x08);
+  return 0;
 }
  
-void
-touchpad_on (void)
+int
+touchpad_on (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0x9e);
-  set_reg (0x9e, r & 0xf7);
-  if (!quiet)
-    printf ("Touchpad is now on.\n");
+  plan_update (ec, 0x9e, 0x08, 0);
+  plan_notify (ec, 0x9e, 0x08);
+  return 0;
 }
 
-void
-wireless_off (void)
+int
+wireless_off (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  set_reg (0xbb, r & 0xfe);
-  if (!quiet)
-    printf ("Wireless is now off.\n");
+  plan_update (ec, 0xbb, 0x01, 0);
+  plan_notify (ec, 0xbb, 0x01);
+  return 0;
 }
 
-void
-wireless_on (void)
+int
+wireless_on (struct ec_session *ec)
 {
-  unsigned char r = get_reg (0xbb);
-  set_reg (0xbb, r | 0x01);
-  if (!quiet)
-    printf ("Wireless is now on.\n");
+  plan_update (ec, 0xbb, 0, 0x01);
+  plan_notify (ec, 0xbb, 0x01);
+  return 0;
 }
 
-void
-show_status (void)
+int
+show_status (struct ec_session *ec)
 {
   int r, i;
+
+  for (i = 0; status_fields[i] != NULL; i++)
+    want_field (&ec->snap, find_field (status_fields[i]));
+  if ((r = snap_fill (ec)) < 0)
+    return r;
+
   /* wireless */
-  r = get_reg (0xbb);
-  if (r & 0x01)
+  if (field_get (ec, "WLAT"))
     printf ("Wireless      : On\n");
   else
     printf ("Wireless      : Off\n");
 
   /* bluetooth */
-  if (r & 0x02)
+  if (field_get (ec, "BTAT"))
     printf ("Bluetooth     : On\n");
   else
     printf ("Bluetooth     : Off\n");
 
   /* touchpad */
-  r = get_reg (0x9e);
-  if (r & 0x08)
+  if (field_get (ec, "TKEY"))
     printf ("Touchpad      : Off\n");
   else
     printf ("Touchpad      : On\n");
 
   /* backlight */
-  r = get_reg (0xb9);
+  r = field_get (ec, "BRTS");
   printf ("Brightness    : [");
   for (i = 0; i < r; i++)
     printf ("+");
@@ -313,20 +1553,17 @@ show_status (void)
   printf ("]\n");
 
   /* temperature */
-  r = get_reg (0xb0);
-  printf ("CPU temp      : %d'C\n", r);
+  printf ("CPU temp      : %ld'C\n", field_get (ec, "CTMP"));
 
   /* Lid Switch */
-  r = get_reg (0x9f);
-  printf ("Lid switch    : %s\n", (r & 0x02) == 0x02 ? "On" : "Off");
+  printf ("Lid switch    : %s\n", field_get (ec, "LIDO") ? "On" : "Off");
 
   /* Adapter Preset */
-  r = get_reg (0xa3);
-  printf ("Power adapter : %s\n", (r & 0x20) == 0x20 ? "Yes" : "No");
+  printf ("Power adapter : %s\n", field_get (ec, "ADPT") ? "Yes" : "No");
 
   /* Battery Status */
   printf ("Batt. status  : ");
-  r = get_reg (0xc1);
+  r = field_get (ec, "BST0");
   if ((r & 0x01) == 0x01)
     printf ("Discharging\n");
   else if ((r & 0x02) == 0x02)
@@ -339,550 +1576,4079 @@ show_status (void)
     printf ("unknown\n");
 
   /* Battery Remain Capacity (mAh) */
-  r = get_reg (0xc3) * 256 + get_reg (0xc2);
-  printf ("Batt. capacity: %d mAh ", r);
-  r = get_reg (0xce);
-  printf ("(%d %%)\n", r);
+  printf ("Batt. capacity: %ld mAh ", field_get (ec, "BRC0"));
+  printf ("(%ld %%)\n", field_get (ec, "GAU0"));
 
   /* Battery Present Voltage (mV) */
-  r = get_reg (0xc7) * 256 + get_reg (0xc6);
-  printf ("Voltage       : %2.3f V\n", r / 1000.0);
+  printf ("Voltage       : %2.3f V\n", field_get (ec, "BPV0") / 1000.0);
+
+  return 0;
 }
 
-void
-dump_fields (void)
+int
+dump_fields (struct ec_session *ec)
 {
-  unsigned int i;
-  unsigned char r;
-
-  r = get_reg (0x08);
-  printf ("BATM %02x ", r);
-  r = get_reg (0x09);
-  printf ("%02x \n", r);
-
-
-  r = get_reg (0x19);
-  printf ("BATD %02x ", r);
-  r = get_reg (0x1a);
-  printf ("%02x ", r);
-  r = get_reg (0x1b);
-  printf ("%02x ", r);
-  r = get_reg (0x1c);
-  printf ("%02x ", r);
-  r = get_reg (0x1d);
-  printf ("%02x ", r);
-  r = get_reg (0x1e);
-  printf ("%02x ", r);
-  r = get_reg (0x1f);
-  printf ("%02x\n", r);
-
-  /* SMB Protocol */
-  r = get_reg (0x60);
-  printf ("SMPR %02x\n", r);
-
-  /* SMB Status */
-  r = get_reg (0x61);
-  printf ("SMST %02x\n", r);
-
-  /* SMB Address */
-  r = get_reg (0x62);
-  printf ("SMAD %02x\n", r);
-
-  /* SMB Command */
-  r = get_reg (0x63);
-  printf ("SMCM %02x\n", r);
-
-  /* SMB Data */
-  r = get_reg (0x64);
-  printf ("SMDR %02x ", r);
-  r = get_reg (0x65);
-  printf ("%02x ", r);
-  r = get_reg (0x66);
-  printf ("%02x ", r);
-  r = get_reg (0x67);
-  printf ("%02x\n", r);
-
-  /* SMB Block Count */
-  r = get_reg (0x68);
-  printf ("BCNT %02x\n", r);
-
-  /* SMB Alarm Address */
-  r = get_reg (0x69);
-  printf ("SMAA %02x\n", r);
-
-  /* SMB Alarm Data 0 */
-  r = get_reg (0x6a);
-  printf ("SMD0 %02x\n", r);
-
-  /* SMB Alarm Data 1 */
-  r = get_reg (0x6b);
-  printf ("SMD1 %02x\n", r);
-
-  r = get_reg (0x94);
-  printf ("ERIB %02x ", r);
-  r = get_reg (0x95);
-  printf ("%02x \n", r);
-
-  r = get_reg (0x96);
-  printf ("ERBD %02x\n", r);
-
-  r = get_reg (0x99);
-  printf ("OSIF %d\n", r & 0x01);
-
-  r = get_reg (0x9a);
-  printf ("BAL1 %d\n", r & 0x01);
-  printf ("BAL2 %d\n", (r & 0x02) == 0x02);
-  printf ("BAL3 %d\n", (r & 0x04) == 0x04);
-  printf ("BAL4 %d\n", (r & 0x08) == 0x08);
-  printf ("BCL1 %d\n", (r & 0x10) == 0x10);
-  printf ("BCL2 %d\n", (r & 0x20) == 0x20);
-  printf ("BCL3 %d\n", (r & 0x40) == 0x40);
-  printf ("BCL4 %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0x9b);
-  printf ("BPU1 %d\n", r & 0x01);
-  printf ("BPU2 %d\n", (r & 0x02) == 0x02);
-  printf ("BPU3 %d\n", (r & 0x04) == 0x04);
-  printf ("BPU4 %d\n", (r & 0x08) == 0x08);
-  printf ("BOS1 %d\n", (r & 0x10) == 0x10);
-  printf ("BOS2 %d\n", (r & 0x20) == 0x20);
-  printf ("BOS3 %d\n", (r & 0x40) == 0x40);
-  printf ("BOS4 %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0x9c);
-  printf ("PHDD %d\n", r & 0x01);
-  printf ("IFDD %d\n", (r & 0x02) == 0x02);
-  printf ("IODD %d\n", (r & 0x04) == 0x04);
-  printf ("SHDD %d\n", (r & 0x08) == 0x08);
-  printf ("LS20 %d\n", (r & 0x10) == 0x10);
-  printf ("EFDD %d\n", (r & 0x20) == 0x20);
-  printf ("ECRT %d\n", (r & 0x40) == 0x40);
-  printf ("LANC %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0x9d);
-  printf ("SBTN %d\n", r & 0x01);
-  printf ("VIDO %d\n", (r & 0x02) == 0x02);
-  printf ("VOLD %d\n", (r & 0x04) == 0x04);
-  printf ("VOLU %d\n", (r & 0x08) == 0x08);
-  printf ("MUTE %d\n", (r & 0x10) == 0x10);
-  printf ("CONT %d\n", (r & 0x20) == 0x20);
-  printf ("BRGT %d\n", (r & 0x40) == 0x40);
-  printf ("HBTN %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0x9e);
-  printf ("S4SE %d\n", r & 0x01);
-  printf ("SKEY %d\n", (r & 0x02) == 0x02);
-  printf ("BKEY %d\n", (r & 0x04) == 0x04);
-  printf ("TKEY %d\n", (r & 0x08) == 0x08);
-  printf ("FKEY %d\n", (r & 0x10) == 0x10);
-  printf ("DVDM %d\n", (r & 0x20) == 0x20);
-  printf ("DIGM %d\n", (r & 0x40) == 0x40);
-  printf ("CDLK %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0x9f);
-  /* Lid Switch */
-  printf ("LIDO %d\n", (r & 0x02) == 0x02);
-  printf ("PMEE %d\n", (r & 0x04) == 0x04);
-  printf ("PBET %d\n", (r & 0x08) == 0x08);
-  printf ("RIIN %d\n", (r & 0x10) == 0x10);
-  printf ("BTWK %d\n", (r & 0x20) == 0x20);
-  printf ("DKIN %d\n", (r & 0x40) == 0x40);
-
-  r = get_reg (0xa0);
-  printf ("SWTH %d\n", (r & 0x40) == 0x40);
-  printf ("HWTH %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xa1);
-  printf ("DTK0 %d\n", r & 0x01);
-  printf ("DTK1 %d\n", (r & 0x02) == 0x02);
-  printf ("OSUD %d\n", (r & 0x10) == 0x10);
-  printf ("OSDK %d\n", (r & 0x20) == 0x20);
-  printf ("OSSU %d\n", (r & 0x40) == 0x40);
-  printf ("DKCG %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xa2);
-  printf ("ODTS %d\n", r);
-
-  r = get_reg (0xa3);
-  printf ("S1LD %d\n", r & 0x01);
-  printf ("S3LD %d\n", (r & 0x02) == 0x02);
-  printf ("VGAQ %d\n", (r & 0x04) == 0x04);
-  printf ("PCMQ %d\n", (r & 0x08) == 0x08);
-  printf ("PCMR %d\n", (r & 0x10) == 0x10);
-  /* Adapter Preset */
-  printf ("ADPT %d\n", (r & 0x20) == 0x20);
-  printf ("SYS6 %d\n", (r & 0x40) == 0x40);
-  printf ("SYS7 %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xa4);
-  printf ("PWAK %d\n", r & 0x01);
-  printf ("MWAK %d\n", (r & 0x02) == 0x02);
-  printf ("LWAK %d\n", (r & 0x04) == 0x04);
-  printf ("RWAK %d\n", (r & 0x08) == 0x08);
-  printf ("KWAK %d\n", (r & 0x40) == 0x40);
-  printf ("MSWK %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xa5);
-  printf ("CCAC %d\n", r & 0x01);
-  printf ("AOAC %d\n", (r & 0x02) == 0x02);
-  printf ("BLAC %d\n", (r & 0x04) == 0x04);
-  printf ("PSRC %d\n", (r & 0x08) == 0x08);
-  printf ("BOAC %d\n", (r & 0x10) == 0x10);
-  printf ("LCAC %d\n", (r & 0x20) == 0x20);
-  printf ("AAAC %d\n", (r & 0x40) == 0x40);
-  printf ("ACAC %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xa6);
-  printf ("PCEC %d\n", r);
-
-  /* Passive Trip Point Temp. */
-  r = get_reg (0xa7);
-  printf ("THON %d\n", r);
-
-  /* Critical Trip Point Temp. */
-  r = get_reg (0xa8);
-  printf ("THSD %d\n", r);
-
-  r = get_reg (0xa9);
-  printf ("THEM %d\n", r);
-
-  r = get_reg (0xaa);
-  printf ("TCON %d\n", r);
-
-  r = get_reg (0xab);
-  printf ("THRS %d\n", r);
-
-  r = get_reg (0xac);
-  printf ("TSSE %d\n", r);
-
-  r = get_reg (0xad);
-  printf ("FSSN %d\n", r & 0x0f);
-  printf ("FANU %d\n", (r & 0xf0) > 4);
-
-  r = get_reg (0xae);
-  printf ("PTVL %d\n", r & 0x07);
-  printf ("TTSR %d\n", (r & 0x40) == 0x40);
-  printf ("TTHR %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xaf);
-  printf ("TSTH %d\n", r & 0x01);
-  printf ("TSBC %d\n", (r & 0x02) == 0x02);
-  printf ("TSBF %d\n", (r & 0x04) == 0x04);
-  printf ("TSPL %d\n", (r & 0x08) == 0x08);
-  printf ("TSBT %d\n", (r & 0x10) == 0x10);
-  printf ("THTA %d\n", (r & 0x80) == 0x80);
-
-  /* CPU Temp */
-  r = get_reg (0xb0);
-  printf ("CTMP %d\n", r);
-
-  r = get_reg (0xb1);
-  printf ("LTMP %d\n", r);
-
-  r = get_reg (0xb2);
-  printf ("SKTA %d\n", r);
-
-  r = get_reg (0xb3);
-  printf ("SKTB %d\n", r);
-
-  r = get_reg (0xb4);
-  printf ("SKTC %d\n", r);
-
-  r = get_reg (0xb5);
-  printf ("SKTD %d\n", r);
-
-  r = get_reg (0xb6);
-  printf ("NBTP %d\n", r);
-
-  r = get_reg (0xb7);
-  printf ("LANP %d\n", r & 0x01);
-  printf ("LCDS %d\n", (r & 0x02) == 0x02);
-
-  r = get_reg (0xb8);
-  printf ("BTPV %d\n", r);
-
-  /* Brightness */
-  r = get_reg (0xb9);
-  printf ("BRTS %d\n", r);
-
-  r = get_reg (0xba);
-  printf ("CRTS %d\n", r);
-
-  r = get_reg (0xbb);
-  /* WLAN Active */
-  printf ("WLAT %d\n", r & 0x01);
-  /* Bluetooth Active */
-  printf ("BTAT %d\n", (r & 0x02) == 0x02);
-  /* WLAN Adapter Present */
-  printf ("WLEX %d\n", (r & 0x04) == 0x04);
-  /* Bluetooth Adapter Present */
-  printf ("BTEX %d\n", (r & 0x08) == 0x08);
-  printf ("KLSW %d\n", (r & 0x10) == 0x10);
-  printf ("WLOK %d\n", (r & 0x20) == 0x20);
-  /* 3G Active */
-  printf ("W3GA %d\n", (r & 0x40) == 0x40);
-  /* 3G Adapter Present */
-  printf ("W3GE %d\n", (r & 0x80) == 0x80);
-
-  r = get_reg (0xbc);
-  printf ("PJID %d\n", r);
-
-  r = get_reg (0xbd);
-  printf ("CPUN %d\n", r);
-
-  r = get_reg (0xbe);
-  printf ("THFN %d\n", r);
-
-  r = get_reg (0xbf);
-  printf ("MLED %d\n", r & 0x01);
-  printf ("SCHG %d\n", (r & 0x02) == 0x02);
-  printf ("SCCF %d\n", (r & 0x04) == 0x04);
-  printf ("SCPF %d\n", (r & 0x08) == 0x08);
-  printf ("ACIS %d\n", (r & 0x10) == 0x10);
-
-  r = get_reg (0xc0);
-  /* Battery Manufacturer */
-  printf ("BTMF %d\n", (r & 0x70) > 4);
-  printf ("BTY0 %d\n", (r & 0x80) == 0x80);
+  const struct ec_field *f;
+  int err;
 
-  /* Battery Status */
-  /* Bit 0 = discharging */
-  /* Bit 1 = charging */
-  /* Bit 2 = critical */
-  r = get_reg (0xc1);
-  printf ("BST0 %d \n", r);
+  for (f = fields; f->name != NULL; f++)
+    want_field (&ec->snap, f);
+  if ((err = snap_fill (ec)) < 0)
+    return err;
 
-  /* Battery Remain Capacity (mAh) */
-  r = get_reg (0xc2);
-  printf ("BRC0 %02x ", r);
-  r = get_reg (0xc3);
-  printf ("%02x\n", r);
+  for (f = fields; f->name != NULL; f++)
+    print_field (f, ec->snap.regs);
 
-  r = get_reg (0xc4);
-  printf ("BSN0 %02x ", r);
-  r = get_reg (0xc5);
-  printf ("%02x\n", r);
+  return 0;
+}
 
-  /* Battery Present Voltage (mV) */
-  r = get_reg (0xc6);
-  printf ("BPV0 %02x ", r);
-  r = get_reg (0xc7);
-  printf ("%02x\n", r);
-
-  /* Battery Design Voltage (mV) */
-  r = get_reg (0xc8);
-  printf ("BDV0 %02x ", r);
-  r = get_reg (0xc9);
-  printf ("%02x\n", r);
+/* 
+ * -g NAME|ADDR|ADDR-ADDR[,...]: fields and registers in one pass.  A
+ * single field or register prints its bare value, as -g always did; 
+ * lists print one "name value" line per item.
+ */
+int
+get_fields (struct ec_session *ec, const char *list)
+{
+  struct ec_query *q;
+  char *copy, *item, *save, *end;
+  int i, n, a, err;
+
+  for (n = 1, i = 0; list[i] != '\0'; i++)
+    n += list[i] == ',';
+  q = calloc (n, sizeof (*q));
+  copy = strdup (list);
+  if (q == NULL || copy == NULL)
+    {
+      perror ("Error allocating query");
+      exit (EXIT_FAILURE);
+    }
+
+  for (n = 0, item = strtok_r (copy, ",", &save); item != NULL; 
+       item = strtok_r (NULL, ",", &save), n++)
+    {
+      if ((q[n].field = find_field (item)) != NULL)
+        {
+          want_field (&ec->snap, q[n].field);
+          continue;
+        }
+
+      q[n].first = q[n].last = strtol (item, &end, 0);
+      if (end != item && *end == '-')
+        q[n].last = strtol (end + 1, &end, 0);
+      if (end == item || *end != '\0' || q[n].first < 0 
+          || q[n].last > 255 || q[n].first > q[n].last)
+        {
+          fprintf (stderr, "Unknown field or register: %s\n", item);
+          exit (EXIT_FAILURE);
+        }
+      for (a = q[n].first; a <= q[n].last; a++)
+        snap_want (&ec->snap, a);
+    }
+
+  if ((err = snap_fill (ec)) < 0)
+    goto out;
+
+  for (i = 0; i < n; i++)
+    {
+      if (q[i].field != NULL && n == 1)
+        printf ("%lu\n", field_value (q[i].field, ec->snap.regs));
+      else if (q[i].field != NULL)
+        printf ("%s %lu\n", q[i].field->name, 
+                field_value (q[i].field, ec->snap.regs));
+      else if (n == 1 && q[i].first == q[i].last)
+        printf ("%d\n", ec->snap.regs[q[i].first]);
+      else
+        for (a = q[i].first; a <= q[i].last; a++)
+          printf ("0x%02x %d\n", a, ec->snap.regs[a]);
+    }
 
-  /* Battery Design Capacity (mAh) */
-  r = get_reg (0xca);
-  printf ("BDC0 %02x ", r);
-  r = get_reg (0xcb);
-  printf ("%02x\n", r);
-
-  /* Battery Full Charge (mAh) */
-  r = get_reg (0xcc);
-  printf ("BFC0 %02x ", r);
-  r = get_reg (0xcd);
-  printf ("%02x\n", r);
-
-  /* Battery Guage (%) */
-  r = get_reg (0xce);
-  printf ("GAU0 %d\n", r);
-
-  r = get_reg (0xcf);
-  printf ("BSCY %d\n", r);
-
-  r = get_reg (0xd0);
-  printf ("BSCU %02x ", r);
-  r = get_reg (0xd1);
-  printf ("%02x\n", r);
+ out:
+  free (copy);
+  free (q);
+  return err;
+}
 
-  r = get_reg (0xd2);
-  printf ("BAC0 %02x ", r);
-  r = get_reg (0xd3);
-  printf ("%02x\n", r);
+/* 
+ * --watch[=NAME[@MS],...]: sample fields on a monotonic timer, print 
+ * those that changed.  Static fields are read once at startup.
+ */
+int
+watch (struct ec_session *ec, const char *list)
+{
+  struct ec_watch *w;
+  char *copy, *item, *save, *at;
+  long long tick, now, a, b;
+  uint64_t expired;
+  int i, n, fd, err = 0;
 
-  r = get_reg (0xd4);
-  printf ("BTW0 %d\n", r);
+  if (list == NULL)
+    {
+      for (n = 0; status_fields[n] != NULL; n++)
+        ;
+    }
+  else
+    for (n = 1, i = 0; list[i] != '\0'; i++)
+      n += list[i] == ',';
 
-  r = get_reg (0xd5);
-  printf ("BATV %d\n", r);
+  w = calloc (n, sizeof (*w));
+  copy = strdup (list ? list : "");
+  if (w == NULL || copy == NULL)
+    {
+      perror ("Error allocating watch list");
+      exit (EXIT_FAILURE);
+    }
 
-  r = get_reg (0xd6);
-  printf ("BPTC %d\n", r);
+  item = list ? strtok_r (copy, ",", &save) : NULL;
+  for (i = 0; i < n; i++)
+    {
+      w[i].interval = interval * 1000000LL;
+      if (list == NULL)
+        w[i].field = find_field (status_fields[i]);
+      else
+        {
+          if ((at = strchr (item, '@')) != NULL)
+            {
+              *at = '\0';
+              w[i].interval = atol (at + 1) * 1000000LL;
+            }
+          w[i].field = find_field (item);
+          if (w[i].field == NULL || w[i].interval <= 0)
+            {
+              fprintf (stderr, "Unknown field: %s\n", item);
+              exit (EXIT_FAILURE);
+            }
+          item = strtok_r (NULL, ",", &save);
+        }
+      if (w[i].field->flags & F_STATIC)
+        w[i].interval = 0;
+    }
 
-  r = get_reg (0xd7);
-  printf ("BTTC %d\n", r);
+  /* timer ticks at the gcd of all intervals */
+  for (i = 0, tick = 0; i < n; i++)
+    {
+      for (a = tick, b = w[i].interval; b != 0; )
+        {
+          long long t = a % b;
+          a = b;
+          b = t;
+        }
+      tick = a;
+    }
+  if (tick == 0)
+    tick = interval * 1000000LL;
+
+  fd = timer_start (tick);
+  catch_signals ();
+
+  /* 
+   * A field is due at the tick nearest to its schedule: a wakeup a 
+   * little early or late must not skip a sample, nor shift the ones 
+   * after it.
+   */
+  for (now = monotonic_ns (); !interrupted; now = monotonic_ns ())
+    {
+      stats_poll (ec);
+      hooks_reap (ec);
+      rules_want (ec);
+      for (i = 0; i < n; i++)
+        if (!w[i].seen || (w[i].interval && w[i].due <= now + tick / 2))
+          {
+            for (a = 0; a < w[i].field->width; a++)
+              snap_invalidate (&ec->snap, w[i].field->offset + a);
+            want_field (&ec->snap, w[i].field);
+          }
+
+      if ((err = snap_fill (ec)) < 0)
+        break;
+      rules_check (ec, ec->snap.regs);
+
+      for (i = 0; i < n; i++)
+        {
+          unsigned long v = field_value (w[i].field, ec->snap.regs);
 
-  r = get_reg (0xd8);
-  printf ("BTMA %02x ", r);
-  r = get_reg (0xd9);
-  printf ("%02x\n", r);
+          if (w[i].seen && (w[i].interval == 0 
+                            || w[i].due > now + tick / 2))
+            continue;
+          if (!w[i].seen || v != w[i].value)
+            {
+              w[i].value = v;
+              watch_print (&w[i]);
+            }
+          if (!w[i].seen)
+            w[i].due = now;
+          w[i].seen = 1;
+          if (w[i].interval)
+            do
+              w[i].due += w[i].interval;
+            while (w[i].due <= now + tick / 2);
+        }
+      fflush (stdout);
+      snap_reset (&ec->snap);
 
-  r = get_reg (0xda);
-  printf ("BTSC %d\n", r);
+      if (read (fd, &expired, sizeof (expired)) == -1 && errno != EINTR)
+        {
+          perror ("Error reading timer");
+          break;
+        }
+    }
 
-  r = get_reg (0xdb);
-  printf ("BCIX %d\n", r);
+  close (fd);
+  free (copy);
+  free (w);
+  return err;
+}
 
-  r = get_reg (0xdc);
-  printf ("CCBA %d\n", r);
+void
+watch_print (const struct ec_watch *w)
+{
+  struct timespec ts;
 
-  r = get_reg (0xdd);
-  printf ("CBOT %d\n", r);
+  clock_gettime (CLOCK_REALTIME, &ts);
+  printf ("%ld.%03ld %s %lu\n", (long) ts.tv_sec, ts.tv_nsec / 1000000L,
+          w->field->name, w->value);
+}
 
-  r = get_reg (0xde);
-  printf ("BTSS %02x ", r);
-  r = get_reg (0xdf);
-  printf ("%02x\n", r);
+/* 
+ * --monitor[=query|acpi]: re-read event_fields only when the EC raises
+ * an event.  "query" owns the EC event queue: SCI_EVT is checked in the
+ * status register every MONITOR_TICK and drained with QR_EC, which 
+ * takes the events from the kernel ACPI driver.  "acpi" leaves them to
+ * the kernel and follows its interrupt counter for the EC GPE (or all
+ * SCIs) instead.  The default is "acpi", except on the emulator and 
+ * replays; without the counters, "query" has to be asked for.
+ */
+int
+monitor (struct ec_session *ec, const char *source)
+{
+  struct ec_watch w[sizeof (event_fields) / sizeof (event_fields[0])];
+  long long now;
+  struct timespec ts;
+  long count = 0, last = -1;
+  uint64_t expired;
+  int i, n, q, fd, counter = -1, event, err = 0;
+
+  /* never take the events from the kernel unless asked to */
+  if ((source == NULL && ec->backend->open != emul_open
+       && ec->backend->open != replay_open)
+      || (source != NULL && strcasecmp (source, "acpi") == 0))
+    {
+      if ((counter = monitor_gpe ()) == -1)
+        {
+          perror ("Error opening " ACPI_INTERRUPTS);
+          if (source == NULL)
+            fprintf (stderr, "--monitor=query reads the EC events itself,"
+                     " taking them from the kernel ACPI driver\n");
+          exit (EXIT_FAILURE);
+        }
+    }
+  else if (source != NULL && strcasecmp (source, "query") != 0)
+    {
+      fprintf (stderr, "Unknown event source: %s\n", source);
+      exit (EXIT_FAILURE);
+    }
+  if (counter == -1 && ec->backend->in == NULL)
+    {
+      fprintf (stderr, "EC queries need a port level backend\n");
+      exit (EXIT_FAILURE);
+    }
 
-  r = get_reg (0xe0);
-  printf ("OVCC %d\n", r);
+  memset (w, 0, sizeof (w));
+  for (n = 0; event_fields[n] != NULL; n++)
+    w[n].field = find_field (event_fields[n]);
 
-  r = get_reg (0xe1);
-  printf ("CCFC %d\n", r);
+  fd = timer_start (MONITOR_TICK * 1000000LL);
+  catch_signals ();
 
-  r = get_reg (0xe2);
-  printf ("BADC %d\n", r);
+  for (event = 1; !interrupted; event = 0)
+    {
+      stats_poll (ec);
+      hooks_reap (ec);
+      if (counter != -1)
+        {
+          if ((count = monitor_count (counter)) != last)
+            {
+              if (last != -1)
+                ec->stats.events++;
+              event = 1;
+              last = count;
+            }
+        }
+      else
+        for (i = 0; i < MONITOR_QUERIES 
+               && (ec->backend->in (ec, EC_SC) & EC_SCI_EVT); i++)
+          {
+            if ((err = q = ec_query (ec)) <= 0)
+              break;
+            ec->stats.events++;
+            event = 1;
+            if (!quiet)
+              {
+                clock_gettime (CLOCK_REALTIME, &ts);
+                printf ("%ld.%03ld QUERY 0x%02x\n", (long) ts.tv_sec, 
+                        ts.tv_nsec / 1000000L, q);
+              }
+          }
+      if (err < 0)
+        break;
+
+      if (event)
+        {
+          for (i = 0; i < n; i++)
+            {
+              snap_invalidate (&ec->snap, w[i].field->offset);
+              want_field (&ec->snap, w[i].field);
+            }
+          rules_want (ec);
+          if ((err = snap_fill (ec)) < 0)
+            break;
+          rules_check (ec, ec->snap.regs);
+          now = monotonic_ns ();
+          for (i = 0; i < n; i++)
+            {
+              unsigned long v = field_value (w[i].field, ec->snap.regs);
+
+              if (!w[i].seen || v != w[i].value)
+                {
+                  w[i].value = v;
+                  watch_print (&w[i]);
+                }
+              w[i].seen = 1;
+              w[i].due = now;
+            }
+          fflush (stdout);
+          snap_reset (&ec->snap);
+        }
 
-  r = get_reg (0xe3);
-  printf ("BSC1 %02x ", r);
-  r = get_reg (0xe4);
-  printf ("%02x\n", r);
+      if (read (fd, &expired, sizeof (expired)) == -1 && errno != EINTR)
+        {
+          perror ("Error reading timer");
+          break;
+        }
+    }
 
-  r = get_reg (0xe5);
-  printf ("BSC2 %02x ", r);
-  r = get_reg (0xe6);
-  printf ("%02x\n", r);
+  close (fd);
+  if (counter != -1)
+    close (counter);
+  return err;
+}
 
-  r = get_reg (0xe7);
-  printf ("BSC3 %02x ", r);
-  r = get_reg (0xe8);
-  printf ("%02x\n", r);
+/* interrupt counter of the EC GPE, or of all SCIs if that is unknown */
+int
+monitor_gpe (void)
+{
+  char path[64], buf[16];
+  int fd, n;
 
-  r = get_reg (0xe9);
-  printf ("BSE4 %02x ", r);
-  r = get_reg (0xea);
-  printf ("%02x\n", r);
+  fd = open (EC_GPE_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+    {
+      n = read (fd, buf, sizeof (buf) - 1);
+      close (fd);
+      if (n > 0)
+        {
+          buf[n] = '\0';
+          snprintf (path, sizeof (path), ACPI_INTERRUPTS "/gpe%02X", 
+                    (unsigned) strtoul (buf, NULL, 0));
+          if ((fd = open (path, O_RDONLY | O_CLOEXEC)) != -1)
+            return fd;
+        }
+    }
 
-  r = get_reg (0xeb);
-  printf ("BDME %02x ", r);
-  r = get_reg (0xec);
-  printf ("%02x\n", r);
+  return open (ACPI_INTERRUPTS "/sci", O_RDONLY | O_CLOEXEC);
+}
 
-  r = get_reg (0xf0);
-  printf ("BTS1 %d\n", r);
+long
+monitor_count (int fd)
+{
+  char buf[64];
+  int n;
 
-  r = get_reg (0xf1);
-  printf ("BTS2 %d\n", r);
+  if ((n = pread (fd, buf, sizeof (buf) - 1, 0)) <= 0)
+    return -1;
+  buf[n] = '\0';
 
-  r = get_reg (0xf2);
-  printf ("BSCS %02x ", r);
-  r = get_reg (0xf3);
-  printf ("%02x\n", r);
+  return strtol (buf, NULL, 10);
+}
 
-  r = get_reg (0xf4);
-  printf ("BDAD %02x ", r);
-  r = get_reg (0xf5);
-  printf ("%02x\n", r);
+/* 
+ * Pop one event from the EC queue (QR_EC).  Returns the query number,
+ * 0 if the queue was empty, or a negative ec_error.
+ */
+int
+ec_query (struct ec_session *ec)
+{
+  int r;
 
-  r = get_reg (0xf6);
-  printf ("BACV %02x ", r);
-  r = get_reg (0xf7);
-  printf ("%02x\n", r);
+  ec_lock (ec);
+  ec->deadline = monotonic_ns () + ec->timeout;
+  if ((r = write_port (ec, QR_EC, EC_SC)) == 0)
+    r = read_port (ec, EC_DATA);
+  if (r < 0)
+    {
+      recover (ec);
+      ec->error_reg = QR_EC;
+    }
+  else
+    ec->stats.transactions++;
+  ec_unlock (ec);
 
-  r = get_reg (0xf8);
-  printf ("BDFC %02x ", r);
-  r = get_reg (0xf9);
-  printf ("%02x\n", r);
+  return r;
 }
 
+/* 
+ * --on=FIELD[&MASK][COND]:ACTION, COND is .change (default), .rise, 
+ * .fall, >N or <N, with /M the level that re-arms the threshold.
+ * Exits on a malformed rule.
+ */
 void
-dump_regs (void)
+rule_add (struct ec_rules *rs, char *arg)
 {
-  unsigned int i;
-  unsigned char r;
+  struct ec_rule *r = &rs->rule[rs->n];
+  char *colon, *p, *end;
+  unsigned char bits, addr;
+  int i, weight;
+
+  if (rs->n == RULES_MAX || (colon = strchr (arg, ':')) == NULL 
+      || colon[1] == '\0')
+    goto invalid;
+  *colon = '\0';
+  r->action = colon + 1;
+  r->fifo = -1;
+  r->mask = ~0UL;
+  r->armed = 1;
+
+  p = arg + strcspn (arg, "&.<>");
+  r->field = NULL;
+  if (*p == '&')
+    {
+      *p = '\0';
+      r->field = find_field (arg);
+      r->mask = strtoul (p + 1, &p, 0);
+    }
+  else if (*p != '\0')
+    {
+      char c = *p;
 
-  printf
-    ("Dump registers (Decimal)\n\n   |   00   01   02   03   04   05   06   07   08   09   0a   0b   0c   0d   0e   0f\n---+--------------------------------------------------------------------------------");
-  init_port ();
-  for (i = 0; i < 256; i++)
+      *p = '\0';
+      r->field = find_field (arg);
+      *p = c;
+    }
+  else
+    r->field = find_field (arg);
+  if (r->field == NULL || r->mask == 0)
+    goto invalid;
+
+  if (*p == '\0' || strcasecmp (p, ".change") == 0)
+    r->cond = RULE_CHANGE;
+  else if (strcasecmp (p, ".rise") == 0)
+    r->cond = RULE_RISE;
+  else if (strcasecmp (p, ".fall") == 0)
+    r->cond = RULE_FALL;
+  else if (*p == '>' || *p == '<')
     {
-      r = get_reg (i);
-      if (i % 16 == 0)
-        printf ("\n%02x | ", i);
+      r->cond = *p == '>' ? RULE_ABOVE : RULE_BELOW;
+      r->level = strtol (p + 1, &end, 0);
+      r->rearm = *end == '/' ? strtol (end + 1, &end, 0) : r->level;
+      if (end == p + 1 || *end != '\0'
+          || (r->cond == RULE_ABOVE ? r->rearm > r->level 
+              : r->rearm < r->level))
+        goto invalid;
+    }
+  else
+    goto invalid;
 
-      printf ("%4d ", r);
+  /* bits of each register the rule depends on */
+  for (i = 0; i < r->field->width; i++)
+    {
+      addr = r->field->offset + i;
+      weight = (r->field->flags & F_BE) ? r->field->width - 1 - i : i;
+      if (r->field->width == 1)
+        bits = (r->mask << r->field->shift) & r->field->mask;
+      else
+        bits = (r->mask >> (8 * weight)) & 0xff;
+      if (bits == 0)
+        continue;
+      if (rs->mask[addr] == 0)
+        rs->regs[rs->nregs++] = addr;
+      rs->mask[addr] |= bits;
+      rs->which[addr] |= 1U << rs->n;
     }
-  printf ("\n");
+  if (r->action[0] == '|')
+    signal (SIGPIPE, SIG_IGN);
+  rs->n++;
+  return;
+
+ invalid:
+  fprintf (stderr, "Invalid rule: %s\n", arg);
+  exit (EXIT_FAILURE);
 }
 
-unsigned char
-get_reg (unsigned char rid)
+unsigned long
+rule_value (const struct ec_rule *r, const unsigned char *regs)
 {
-  unsigned char r;
-
-  init_port ();
-  write_port (RD_EC, EC_SC);
-  write_port (rid, EC_DATA);
-  r = read_port (EC_DATA);
-
-  return r;
+  return field_value (r->field, regs) & r->mask;
 }
 
+/* sample the registers of all rules in the next snapshot */
 void
-set_reg (unsigned char rid, unsigned char r)
+rules_want (struct ec_session *ec)
 {
-  init_port ();
-  write_port (WR_EC, EC_SC);
-  write_port (rid, EC_DATA);
-  write_port (r, EC_DATA);
+  struct ec_rules *rs = &ec->rules;
+  int i;
+
+  for (i = 0; i < rs->nregs; i++)
+    {
+      snap_invalidate (&ec->snap, rs->regs[i]);
+      snap_want (&ec->snap, rs->regs[i]);
+    }
 }
 
+/* 
+ * Compare a sample against the previous one and fire the rules whose
+ * condition it meets.  The first sample only sets the baseline, and 
+ * fires thresholds that are already crossed.
+ */
 void
-init_port (void)
+rules_check (struct ec_session *ec, const unsigned char *regs)
 {
-  if (ioperm (EC_SC, 1, 1) == -1)
+  struct ec_rules *rs = &ec->rules;
+  struct ec_rule *r;
+  unsigned long old, v;
+  uint32_t pending = 0;
+  int i, addr;
+
+  if (rs->n == 0)
+    return;
+
+  if (!rs->primed)
     {
-      perror ("Error opening port");
-      exit (EXIT_FAILURE);
+      memcpy (rs->prev, regs, sizeof (rs->prev));
+      for (i = 0; i < rs->n; i++)
+        if (rs->rule[i].cond >= RULE_ABOVE)
+          pending |= 1U << i;
+      rs->primed = 1;
     }
-
-  if (ioperm (EC_DATA, 1, 1) == -1)
+  for (i = 0; i < rs->nregs; i++)
     {
-      perror ("Error opening port");
-      exit (EXIT_FAILURE);
+      addr = rs->regs[i];
+      if ((regs[addr] ^ rs->prev[addr]) & rs->mask[addr])
+        pending |= rs->which[addr];
     }
-}
 
-unsigned char
-read_port (unsigned char port)
-{
-  /* check if port is available for read */
-  while (!(inb (EC_SC) & 0x01))
+  for (i = 0; pending != 0; i++, pending >>= 1)
     {
-      struct timespec ts;
-      ts.tv_sec = (time_t) 0;
-      ts.tv_nsec = 100000;
-      nanosleep (&ts, NULL);
+      if (!(pending & 1))
+        continue;
+      r = &rs->rule[i];
+      old = rule_value (r, rs->prev);
+      v = rule_value (r, regs);
+      switch (r->cond)
+        {
+        case RULE_CHANGE:
+          if (v != old)
+            hook_run (ec, r, old, v);
+          break;
+        case RULE_RISE:
+        case RULE_FALL:
+          if (!old != !v && !v == (r->cond == RULE_FALL))
+            hook_run (ec, r, old, v);
+          break;
+        case RULE_ABOVE:
+        case RULE_BELOW:
+          if (r->armed && (r->cond == RULE_ABOVE ? (long) v > r->level
+                           : (long) v < r->level))
+            {
+              r->armed = 0;
+              hook_run (ec, r, old, v);
+            }
+          else if (!r->armed && (r->cond == RULE_ABOVE 
+                                 ? (long) v <= r->rearm
+                                 : (long) v >= r->rearm))
+            r->armed = 1;
+          break;
+        }
     }
 
-  return inb (port);
+  for (i = 0; i < rs->nregs; i++)
+    rs->prev[rs->regs[i]] = regs[rs->regs[i]];
 }
 
+/* 
+ * Run a rule's action without waiting for it: commands are forked and
+ * reaped later, FIFO lines are dropped while nobody reads.
+ */
 void
-write_port (unsigned char data, unsigned char port)
+hook_run (struct ec_session *ec, struct ec_rule *r, unsigned long old,
+          unsigned long v)
 {
-  /* check if port is available for write */
-  while (inb (EC_SC) & 0x02)
+  struct timespec ts;
+  char line[80], value[24];
+  int n;
+  pid_t pid;
+
+  if (r->action[0] == '|')
     {
-      struct timespec ts;
-      ts.tv_sec = (time_t) 0;
-      ts.tv_nsec = 100000;
+      if (r->fifo == -1)
+        r->fifo = open (r->action + 1, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+      clock_gettime (CLOCK_REALTIME, &ts);
+      n = snprintf (line, sizeof (line), "%ld.%03ld %s %lu %lu\n", 
+                    (long) ts.tv_sec, ts.tv_nsec / 1000000L, 
+                    r->field->name, v, old);
+      if (r->fifo == -1 || write (r->fifo, line, n) != n)
+        {
+          if (r->fifo != -1 && errno == EPIPE)
+            {
+              close (r->fifo);
+              r->fifo = -1;
+            }
+          ec->stats.hooks_dropped++;
+          return;
+        }
+      ec->stats.hooks++;
+      return;
+    }
+
+  if (ec->rules.running >= HOOKS_MAX || (pid = fork ()) == -1)
+    {
+      ec->stats.hooks_dropped++;
+      return;
+    }
+  if (pid == 0)
+    {
+      signal (SIGPIPE, SIG_DFL);
+      setenv ("ACER_EC_FIELD", r->field->name, 1);
+      snprintf (value, sizeof (value), "%lu", v);
+      setenv ("ACER_EC_VALUE", value, 1);
+      snprintf (value, sizeof (value), "%lu", old);
+      setenv ("ACER_EC_OLD", value, 1);
+      execl ("/bin/sh", "sh", "-c", r->action, (char *) NULL);
+      _exit (127);
+    }
+  ec->rules.running++;
+  ec->stats.hooks++;
+}
+
+void
+hooks_reap (struct ec_session *ec)
+{
+  while (ec->rules.running > 0 && waitpid (-1, NULL, WNOHANG) > 0)
+    ec->rules.running--;
+}
+
+/* periodic CLOCK_MONOTONIC timer, first expiry after one period */
+int
+timer_start (long long period)
+{
+  struct itimerspec its;
+  int fd;
+
+  fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd == -1)
+    {
+      perror ("Error creating timer");
+      exit (EXIT_FAILURE);
+    }
+  its.it_interval.tv_sec = period / 1000000000LL;
+  its.it_interval.tv_nsec = period % 1000000000LL;
+  its.it_value = its.it_interval;
+  timerfd_settime (fd, 0, &its, NULL);
+
+  return fd;
+}
+
+void
+on_signal (int sig)
+{
+  if (sig == SIGUSR1)
+    stats_requested = 1;
+  else
+    interrupted = 1;
+}
+
+/* 
+ * Stop long running modes cleanly on SIGINT, SIGTERM, SIGHUP; SIGUSR1
+ * prints statistics.
+ */
+void
+catch_signals (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = on_signal;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGHUP, &sa, NULL);
+  sigaction (SIGUSR1, &sa, NULL);
+}
+
+/* statistics asked for with SIGUSR1 */
+void
+stats_poll (struct ec_session *ec)
+{
+  if (!stats_requested)
+    return;
+  stats_requested = 0;
+  stats_print (ec, ec->stats_format ? ec->stats_format : STATS_TEXT);
+}
+
+/* 
+ * --batch=FILE: run a command stream in this session, one command per
+ * line, results go to stdout as each line completes.  A failed line is
+ * reported and the rest of the stream still runs.  Returns the exit 
+ * status.
+ */
+int
+batch (struct ec_session *ec, const char *path)
+{
+  FILE *fp = stdin;
+  char *line = NULL, *text;
+  size_t size = 0;
+  int lineno = 0, err, status = EXIT_SUCCESS;
+
+  if (strcmp (path, "-") != 0 && (fp = fopen (path, "r")) == NULL)
+    {
+      perror ("Error opening batch file");
+      exit (EXIT_FAILURE);
+    }
+
+  while (getline (&line, &size, fp) != -1)
+    {
+      lineno++;
+      if ((text = strdup (line)) == NULL)
+        {
+          perror ("Error reading batch file");
+          exit (EXIT_FAILURE);
+        }
+      text[strcspn (text, "\r\n")] = '\0';
+
+      err = batch_line (ec, line);
+      fflush (stdout);
+      if (err > 0)
+        fprintf (stderr, "%s:%d: cannot parse: %s\n", path, lineno, text);
+      else if (err < 0)
+        {
+          fprintf (stderr, "%s:%d: ", path, lineno);
+          report (ec, err);
+        }
+      if (err != 0)
+        status = EXIT_FAILURE;
+      free (text);
+    }
+
+  if ((err = plan_flush (ec)) < 0)
+    {
+      fprintf (stderr, "%s:%d: ", path, lineno);
+      report (ec, err);
+      status = EXIT_FAILURE;
+    }
+
+  free (line);
+  if (fp != stdin)
+    fclose (fp);
+
+  return status;
+}
+
+/* 
+ * One --batch command.  Returns 0, a negative ec_error, or 1 if the 
+ * line does not parse.
+ *
+ *   get LIST                  as -g
+ *   set TARGET VALUE          register or field, read-modify-write for 
+ *                             fields narrower than a byte
+ *   bitset TARGET [MASK]      set the bits of a one-byte field, or MASK
+ *   bitclr TARGET [MASK]      of a register
+ *   bluetooth|touchpad|wireless [on|off|toggle]
+ *   backlight N
+ *   status | dump | registers
+ *   sleep MS                  also discards the register image
+ *   snapshot                  discard the register image
+ */
+int
+batch_line (struct ec_session *ec, char *line)
+{
+  const struct ec_switch *sw;
+  const struct ec_field *f;
+  struct ec_field reg;
+  char *cmd, *arg, *val, *save, *end;
+  unsigned long v = 0;
+  struct timespec ts;
+  int err;
+
+  cmd = strtok_r (line, " \t\r\n", &save);
+  if (cmd == NULL || *cmd == '#')
+    return 0;
+  arg = strtok_r (NULL, " \t\r\n", &save);
+  val = arg ? strtok_r (NULL, " \t\r\n", &save) : NULL;
+  if (val != NULL && strtok_r (NULL, " \t\r\n", &save) != NULL)
+    return 1;
+  if (val != NULL)
+    {
+      v = strtoul (val, &end, 0);
+      if (end == val || *end != '\0')
+        return 1;
+    }
+
+  for (sw = switches; sw->name != NULL; sw++)
+    if (strcasecmp (cmd, sw->name) == 0)
+      {
+        if (val != NULL)
+          return 1;
+        if (arg == NULL || strcasecmp (arg, "toggle") == 0)
+          return sw->toggle (ec);
+        if (strcasecmp (arg, "on") == 0)
+          return sw->on (ec);
+        if (strcasecmp (arg, "off") == 0)
+          return sw->off (ec);
+        return 1;
+      }
+
+  if (arg == NULL)
+    {
+      if (strcasecmp (cmd, "status") == 0)
+        return show_status (ec);
+      if (strcasecmp (cmd, "dump") == 0)
+        return dump_fields (ec);
+      if (strcasecmp (cmd, "registers") == 0)
+        return dump_regs (ec);
+      if (strcasecmp (cmd, "snapshot") == 0)
+        {
+          snap_reset (&ec->snap);
+          return plan_flush (ec);
+        }
+      return 1;
+    }
+
+  if (strcasecmp (cmd, "get") == 0 && val == NULL)
+    return get_fields (ec, arg);
+
+  if (strcasecmp (cmd, "sleep") == 0 && val == NULL)
+    {
+      v = strtoul (arg, &end, 0);
+      if (end == arg || *end != '\0')
+        return 1;
+      ts.tv_sec = v / 1000;
+      ts.tv_nsec = (v % 1000) * 1000000L;
+      if ((err = plan_flush (ec)) < 0)
+        return err;
+      while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+        ;
+      snap_reset (&ec->snap);
+      return 0;
+    }
+
+  if (strcasecmp (cmd, "backlight") == 0 && val == NULL)
+    {
+      plan_update (ec, 0xb9, 0xff, atoi (arg) % 10);
+      return 0;
+    }
+
+  if ((f = batch_target (arg, &reg)) == NULL)
+    return 1;
+
+  if (strcasecmp (cmd, "set") == 0 && val != NULL)
+    {
+      field_set (ec, f, v);
+      return 0;
+    }
+
+  if (strcasecmp (cmd, "bitset") == 0 || strcasecmp (cmd, "bitclr") == 0)
+    {
+      if (f == &reg && val == NULL)
+        return 1;
+      if (f != &reg && (val != NULL || f->width != 1))
+        return 1;
+      if (f != &reg)
+        v = f->mask;
+      if (strcasecmp (cmd, "bitset") == 0)
+        plan_update (ec, f->offset, 0, v);
+      else
+        plan_update (ec, f->offset, v, 0);
+      return 0;
+    }
+
+  return 1;
+}
+
+/* field by name, or a one-byte field in reg for a register number */
+const struct ec_field *
+batch_target (const char *arg, struct ec_field *reg)
+{
+  const struct ec_field *f;
+  char *end;
+  long a;
+
+  if ((f = find_field (arg)) != NULL)
+    return f;
+
+  a = strtol (arg, &end, 0);
+  if (end == arg || *end != '\0' || a < 0 || a > 255)
+    return NULL;
+  memset (reg, 0, sizeof (*reg));
+  reg->offset = a;
+  reg->width = 1;
+  reg->mask = 0xff;
+
+  return reg;
+}
+
+int
+dump_regs (struct ec_session *ec)
+{
+  unsigned int i;
+  const unsigned char *regs = ec->snap.regs;
+  int err;
+
+  for (i = 0; i < 256; i++)
+    snap_want (&ec->snap, i);
+  if ((err = snap_fill (ec)) < 0)
+    return err;
+
+  printf
+    ("Dump registers (Decimal)\n\n   |   00   01   02   03   04   05   06   07   08   09   0a   0b   0c   0d   0e   0f\n---+--------------------------------------------------------------------------------");
+  for (i = 0; i < 256; i++)
+    {
+      if (i % 16 == 0)
+        printf ("\n%02x | ", i);
+
+      printf ("%4d ", regs[i]);
+    }
+  printf ("\n");
+
+  return 0;
+}
+
+/* 
+ * Read register rid.  Returns the value, or a negative ec_error once
+ * every retry has run into its deadline.
+ */
+int
+get_reg (struct ec_session *ec, unsigned char rid)
+{
+  unsigned char image[256];
+  int r, attempt;
+  long long start = monotonic_ns ();
+
+  if (ec->backend->read != NULL)
+    {
+      ec_lock (ec);
+      r = ec->backend->read (ec, &rid, 1, image);
+      ec_unlock (ec);
+      if (r < 0)
+        return r;
+      ec->stats.transactions++;
+      ec->stats.bytes_read++;
+      hist_add (&ec->stats.read, monotonic_ns () - start);
+      return image[rid];
+    }
+
+  ec_lock (ec);
+  for (attempt = 0; ; attempt++)
+    {
+      ec->deadline = monotonic_ns () + ec->timeout;
+      if ((r = write_port (ec, RD_EC, EC_SC)) == 0
+          && (r = write_port (ec, rid, EC_DATA)) == 0
+          && (r = read_port (ec, EC_DATA)) >= 0)
+        break;
+
+      if (attempt == ec->retries)
+        {
+          ec_unlock (ec);
+          ec->error_reg = rid;
+          return r;
+        }
+      ec->stats.retries++;
+      recover (ec);
+    }
+  ec_unlock (ec);
+  ec->stats.transactions++;
+  ec->stats.bytes_read++;
+  hist_add (&ec->stats.read, monotonic_ns () - start);
+
+  return r;
+}
+
+int
+set_reg (struct ec_session *ec, unsigned char rid, unsigned char r)
+{
+  int err, attempt;
+  long long start = monotonic_ns ();
+
+  if (ec->backend->write != NULL)
+    {
+      ec_lock (ec);
+      err = ec->backend->write (ec, rid, r);
+      ec_unlock (ec);
+      if (err < 0)
+        return err;
+      ec->stats.transactions++;
+      ec->stats.bytes_written++;
+      hist_add (&ec->stats.write, monotonic_ns () - start);
+      snap_invalidate (&ec->snap, rid);
+      if (ec->statics.valid[rid >> 3] & (1 << (rid & 7)))
+        {
+          ec->statics.valid[rid >> 3] &= ~(1 << (rid & 7));
+          ec->static_dirty = 1;
+        }
+      return 0;
+    }
+
+  ec_lock (ec);
+  for (attempt = 0; ; attempt++)
+    {
+      ec->deadline = monotonic_ns () + ec->timeout;
+      if ((err = write_port (ec, WR_EC, EC_SC)) == 0
+          && (err = write_port (ec, rid, EC_DATA)) == 0
+          && (err = write_port (ec, r, EC_DATA)) == 0)
+        break;
+
+      if (attempt == ec->retries)
+        {
+          ec_unlock (ec);
+          ec->error_reg = rid;
+          return err;
+        }
+      ec->stats.retries++;
+      recover (ec);
+    }
+  ec_unlock (ec);
+  ec->stats.transactions++;
+  ec->stats.bytes_written++;
+  hist_add (&ec->stats.write, monotonic_ns () - start);
+  snap_invalidate (&ec->snap, rid);
+  if (ec->statics.valid[rid >> 3] & (1 << (rid & 7)))
+    {
+      ec->statics.valid[rid >> 3] &= ~(1 << (rid & 7));
+      ec->static_dirty = 1;
+    }
+
+  return 0;
+}
+
+/* 
+ * Bring the EC back to a known state after a failed transaction: drain
+ * a stale byte from OBF and wait for IBF to clear, so that the command 
+ * can be issued again.
+ */
+void
+recover (struct ec_session *ec)
+{
+  int i;
+
+  ec->deadline = monotonic_ns () + ec->timeout;
+  for (i = 0; i < 256 && (ec->backend->in (ec, EC_SC) & EC_OBF); i++)
+    ec->backend->in (ec, EC_DATA);
+  wait_port (ec, EC_IBF, 0);
+  ec->stats.recoveries++;
+}
+
+/* 
+ * Inter-process lock 
+ *
+ * flock() on a lock file around each transaction (a burst, a planned
+ * read-modify-write), so that other acer-ec processes cannot mix their
+ * bytes into ours.  Every backend that writes takes LOCK_PATH unless 
+ * --lock says otherwise: ec_sys keeps single accesses whole, but not a
+ * read-modify-write.  The broker does those itself (BROKER_UPDATE), and
+ * a published snapshot cannot be written.
+ */
+void
+lock_open (struct ec_session *ec)
+{
+  const char *path = ec->lock_path;
+
+  if (path == NULL && ec->backend->update == NULL 
+      && ec->backend->open != shm_open_reader
+      && ec->backend->open != emul_open && ec->backend->open != replay_open)
+    path = LOCK_PATH;
+  if (path != NULL && *path != '\0')
+    {
+      ec->lock_fd = open (path, (ec->rate ? O_RDWR : O_RDONLY) | O_CREAT 
+                          | O_CLOEXEC, 0644);
+      if (ec->lock_fd == -1 && (ec->lock_path != NULL || ec->rate))
+        {
+          perror ("Error opening lock file");
+          exit (EXIT_FAILURE);
+        }
+    }
+  if (!ec->rate)
+    return;
+
+  /* the token bucket lives in the lock file, or in this process only */
+  if (ec->lock_fd == -1)
+    ec->bucket = calloc (1, sizeof (*ec->bucket));
+  else if (ftruncate (ec->lock_fd, sizeof (*ec->bucket)) == 0)
+    ec->bucket = mmap (NULL, sizeof (*ec->bucket), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ec->lock_fd, 0);
+  if (ec->bucket == NULL || ec->bucket == MAP_FAILED)
+    {
+      perror ("Error setting up rate limit");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* nested calls take the lock, and a --rate token, once */
+void
+ec_lock (struct ec_session *ec)
+{
+  long long start;
+
+  if (ec->lock_depth++ > 0)
+    return;
+
+  if (ec->lock_fd != -1)
+    {
+      ec->stats.syscalls++;
+      if (flock (ec->lock_fd, LOCK_EX | LOCK_NB) == 0)
+        hist_add (&ec->stats.lock, 0);
+      else
+        {
+          start = monotonic_ns ();
+          ec->stats.lock_waits++;
+          while (flock (ec->lock_fd, LOCK_EX) == -1 && errno == EINTR)
+            ;
+          ec->stats.syscalls++;
+          hist_add (&ec->stats.lock, monotonic_ns () - start);
+        }
+    }
+
+  if (ec->rate)
+    rate_take (ec);
+}
+
+void
+ec_unlock (struct ec_session *ec)
+{
+  if (--ec->lock_depth > 0 || ec->lock_fd == -1)
+    return;
+
+  flock (ec->lock_fd, LOCK_UN);
+  ec->stats.syscalls++;
+}
+
+/* 
+ * Take one token, under the lock.  Without one, the token is reserved
+ * ahead (the bucket goes negative) and we sleep until it is due with
+ * the lock released, so that waiting processes queue up in order.
+ */
+void
+rate_take (struct ec_session *ec)
+{
+  struct ec_bucket *b = ec->bucket;
+  struct timespec ts;
+  long long now = monotonic_ns (), wait;
+
+  if (b->magic != BUCKET_MAGIC || now < b->stamp)
+    {
+      b->magic = BUCKET_MAGIC;
+      b->tokens = ec->rate_burst;
+      b->stamp = now;
+    }
+
+  b->tokens += (now - b->stamp) * ec->rate / 1e9;
+  if (b->tokens > ec->rate_burst)
+    b->tokens = ec->rate_burst;
+  b->stamp = now;
+  b->tokens -= 1;
+  if (b->tokens >= 0)
+    return;
+
+  wait = -b->tokens * 1e9 / ec->rate;
+  ec->stats.throttled++;
+  hist_add (&ec->stats.rate, wait);
+
+  if (ec->lock_fd != -1)
+    flock (ec->lock_fd, LOCK_UN);
+  ts.tv_sec = wait / 1000000000LL;
+  ts.tv_nsec = wait % 1000000000LL;
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+  if (ec->lock_fd != -1)
+    while (flock (ec->lock_fd, LOCK_EX) == -1 && errno == EINTR)
+      ;
+}
+
+/* 
+ * Read a sorted list of registers into regs[].  Uses one burst for the
+ * whole list, byte mode if the EC does not acknowledge burst.
+ */
+int
+read_regs (struct ec_session *ec, const unsigned char *addrs, int n, 
+           unsigned char *regs)
+{
+  sigset_t block, saved;
+  int i, r = 0;
+  long long start = monotonic_ns ();
+
+  if (ec->backend->read != NULL)
+    {
+      /* one pass, one --rate token */
+      ec_lock (ec);
+      r = ec->backend->read (ec, addrs, n, regs);
+      ec_unlock (ec);
+      if (r < 0)
+        return r;
+      ec->stats.transactions++;
+      ec->stats.bytes_read += n;
+      hist_add (&ec->stats.pass, monotonic_ns () - start);
+      return 0;
+    }
+
+  if (n > 1 && !ec->no_burst)
+    {
+      /* keep signals away until burst mode is disabled again */
+      sigemptyset (&block);
+      sigaddset (&block, SIGINT);
+      sigaddset (&block, SIGTERM);
+      sigaddset (&block, SIGHUP);
+      sigprocmask (SIG_BLOCK, &block, &saved);
+      ec_lock (ec);
+
+      if (burst_enable (ec) == 0)
+        {
+          for (i = 0; i < n && (r = get_reg (ec, addrs[i])) >= 0; i++)
+            regs[addrs[i]] = r;
+          ec->stats.burst_bytes += i;
+          burst_disable (ec);
+          ec_unlock (ec);
+          sigprocmask (SIG_SETMASK, &saved, NULL);
+          hist_add (&ec->stats.pass, monotonic_ns () - start);
+          return r < 0 ? r : 0;
+        }
+      ec_unlock (ec);
+      sigprocmask (SIG_SETMASK, &saved, NULL);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if ((r = get_reg (ec, addrs[i])) < 0)
+        return r;
+      regs[addrs[i]] = r;
+    }
+
+  return 0;
+}
+
+/* 
+ * Register map 
+ */
+const struct ec_field *
+find_field (const char *name)
+{
+  const struct ec_field *f;
+
+  for (f = fields; f->name != NULL; f++)
+    if (strcasecmp (f->name, name) == 0)
+      return f;
+
+  return NULL;
+}
+
+void
+want_field (struct ec_snapshot *snap, const struct ec_field *f)
+{
+  int i;
+
+  for (i = 0; i < f->width; i++)
+    snap_want (snap, f->offset + i);
+}
+
+/* decoded value, multi-byte fields are combined */
+unsigned long
+field_value (const struct ec_field *f, const unsigned char *regs)
+{
+  unsigned long v = 0;
+  int i, shift;
+
+  if (f->width == 1)
+    return (regs[f->offset] & f->mask) >> f->shift;
+
+  for (i = 0; i < f->width; i++)
+    {
+      shift = 8 * ((f->flags & F_BE) ? f->width - 1 - i : i);
+      v |= (unsigned long) regs[f->offset + i] << shift;
+    }
+
+  return v;
+}
+
+/* value of a field already captured in the session snapshot */
+long
+field_get (struct ec_session *ec, const char *name)
+{
+  return field_value (find_field (name), ec->snap.regs);
+}
+
+/* 
+ * Queue a write of a field.  Fields narrower than a byte keep the other
+ * bits of their register, multi-byte fields are written byte by byte.
+ */
+void
+field_set (struct ec_session *ec, const struct ec_field *f, unsigned long v)
+{
+  int i, shift;
+
+  if (f->width == 1)
+    {
+      plan_update (ec, f->offset, f->mask, (v << f->shift) & f->mask);
+      return;
+    }
+
+  for (i = 0; i < f->width; i++)
+    {
+      shift = 8 * ((f->flags & F_BE) ? f->width - 1 - i : i);
+      plan_update (ec, f->offset + i, 0xff, v >> shift);
+    }
+}
+
+void
+print_field (const struct ec_field *f, const unsigned char *regs)
+{
+  int i;
+
+  printf ("%s", f->name);
+  if (f->flags & F_HEX)
+    for (i = 0; i < f->width; i++)
+      printf (" %02x", regs[f->offset + i]);
+  else
+    printf (" %lu", field_value (f, regs));
+  printf ("\n");
+}
+
+/* 
+ * Register snapshot 
+ *
+ * Commands mark the registers they decode with snap_want(), snap_fill() 
+ * then captures those not yet in the shadow image with one sorted 
+ * read_regs() pass.  Registers stay valid for the rest of the 
+ * invocation; a write invalidates its register.
+ */
+void
+snap_reset (struct ec_snapshot *snap)
+{
+  memset (snap->want, 0, sizeof (snap->want));
+  memset (snap->valid, 0, sizeof (snap->valid));
+}
+
+void
+snap_want (struct ec_snapshot *snap, unsigned char addr)
+{
+  snap->want[addr >> 3] |= 1 << (addr & 7);
+}
+
+void
+snap_invalidate (struct ec_snapshot *snap, unsigned char addr)
+{
+  snap->valid[addr >> 3] &= ~(1 << (addr & 7));
+}
+
+/* apply pending writes, then capture the wanted registers */
+int
+snap_fill (struct ec_session *ec)
+{
+  int err;
+
+  if ((err = plan_flush (ec)) < 0)
+    {
+      memcpy (ec->snap.want, ec->snap.valid, sizeof (ec->snap.want));
+      return err;
+    }
+
+  return snap_read (ec);
+}
+
+/* 
+ * Capture the wanted registers.  Multi-byte fields that change at 
+ * runtime are read as a unit: within the burst when there is one, 
+ * otherwise separately by snap_stable().
+ */
+int
+snap_read (struct ec_session *ec)
+{
+  struct ec_snapshot *snap = &ec->snap;
+  const struct ec_field *f;
+  unsigned char addrs[256], pending[32], apart[32];
+  int i, n, total, atomic, no_burst = ec->no_burst, err = 0;
+
+  for (i = total = 0; i < 32; i++)
+    {
+      pending[i] = snap->want[i] & ~snap->valid[i];
+      total += __builtin_popcount (pending[i]);
+    }
+  if (total == 0)
+    return 0;
+  if (ec->static_path != NULL && static_fill (ec, pending) == total)
+    goto done;
+
+  memset (apart, 0, sizeof (apart));
+  if (!(atomic = snap_atomic (ec, total)) && ec->backend->read == NULL)
+    for (f = fields; f->name != NULL; f++)
+      if (tearable (f) && (pending[f->offset >> 3] & (1 << (f->offset & 7))))
+        for (i = 0; i < f->width; i++)
+          apart[(f->offset + i) >> 3] |= 1 << ((f->offset + i) & 7);
+
+  for (i = n = 0; i < 256; i++)
+    if ((pending[i >> 3] & ~apart[i >> 3]) & (1 << (i & 7)))
+      addrs[n++] = i;
+
+  if (n > 0)
+    err = read_regs (ec, addrs, n, snap->regs);
+
+  /* burst refused during this pass, it was not atomic after all */
+  if (atomic && ec->no_burst != no_burst)
+    memcpy (apart, pending, sizeof (apart));
+
+  for (f = fields; err == 0 && f->name != NULL; f++)
+    if (tearable (f) && (apart[f->offset >> 3] & (1 << (f->offset & 7))))
+      err = snap_stable (ec, f);
+  if (err == 0 && !atomic && ec->backend->read != NULL)
+    err = snap_settle (ec, pending);
+
+  if (err < 0)
+    {
+      /* do not retry them with the next request */
+      memcpy (snap->want, snap->valid, sizeof (snap->want));
+      return err;
+    }
+  if (ec->static_state > 0)
+    static_store (ec, pending);
+
+ done:
+  for (i = 0; i < 32; i++)
+    snap->valid[i] |= snap->want[i];
+  ec->stats.snapshot_regs += total;
+
+  return 0;
+}
+
+/* 
+ * Whether a pass over n registers sees one consistent image.  The EC
+ * does not update its registers while in burst mode; the broker and 
+ * the shared memory snapshot are consistent already.  ec_sys reads 
+ * byte by byte.
+ */
+int
+snap_atomic (struct ec_session *ec, int n)
+{
+  if (ec->backend->read != NULL)
+    return ec->backend->read != ecsys_read;
+
+  return n > 1 && !ec->no_burst;
+}
+
+/* 
+ * Register level backend without atomic passes (ec_sys): read all 
+ * multi-byte fields of the pass again, together, until each reads the 
+ * same twice in a row.  One extra pass in the common case, instead of
+ * three per field.
+ */
+int
+snap_settle (struct ec_session *ec, const unsigned char *pending)
+{
+  const struct ec_field *f;
+  unsigned char addrs[256], again[256], unsettled[32];
+  int i, n, attempt, err;
+
+  memset (unsettled, 0, sizeof (unsettled));
+  for (f = fields; f->name != NULL; f++)
+    if (tearable (f) && (pending[f->offset >> 3] & (1 << (f->offset & 7))))
+      unsettled[f->offset >> 3] |= 1 << (f->offset & 7);
+
+  for (attempt = 0; attempt <= TEAR_RETRIES; attempt++)
+    {
+      for (f = fields, n = 0; f->name != NULL; f++)
+        if (tearable (f) 
+            && (unsettled[f->offset >> 3] & (1 << (f->offset & 7))))
+          for (i = 0; i < f->width; i++)
+            addrs[n++] = f->offset + i;
+      if (n == 0)
+        break;
+      if (attempt > 0)
+        ec->stats.tear_retries++;
+      if ((err = read_regs (ec, addrs, n, again)) < 0)
+        return err;
+
+      for (f = fields; f->name != NULL; f++)
+        {
+          if (!tearable (f)
+              || !(unsettled[f->offset >> 3] & (1 << (f->offset & 7))))
+            continue;
+          if (memcmp (again + f->offset, ec->snap.regs + f->offset, 
+                      f->width) == 0)
+            unsettled[f->offset >> 3] &= ~(1 << (f->offset & 7));
+          else
+            memcpy (ec->snap.regs + f->offset, again + f->offset, 
+                    f->width);
+        }
+    }
+
+  return 0;
+}
+
+/* multi-byte field that may change between two byte reads */
+int
+tearable (const struct ec_field *f)
+{
+  return f->width > 1 && !(f->flags & F_STATIC);
+}
+
+/* 
+ * Read a multi-byte field outside burst mode: upper bytes, low byte, 
+ * upper bytes again, until the upper bytes stay the same.  A carry or
+ * borrow out of the low byte then cannot have happened in between.
+ */
+int
+snap_stable (struct ec_session *ec, const struct ec_field *f)
+{
+  unsigned char upper[8], low, again[256];
+  int i, n, attempt, err;
+
+  low = (f->flags & F_BE) ? f->offset + f->width - 1 : f->offset;
+  for (i = n = 0; i < f->width; i++)
+    if (f->offset + i != low)
+      upper[n++] = f->offset + i;
+
+  if ((err = read_regs (ec, upper, n, ec->snap.regs)) < 0)
+    return err;
+
+  for (attempt = 0; ; attempt++)
+    {
+      if ((err = read_regs (ec, &low, 1, ec->snap.regs)) < 0
+          || (err = read_regs (ec, upper, n, again)) < 0)
+        return err;
+
+      for (i = 0; i < n && again[upper[i]] == ec->snap.regs[upper[i]]; i++)
+        ;
+      if (i == n || attempt == TEAR_RETRIES)
+        break;
+
+      for (i = 0; i < n; i++)
+        ec->snap.regs[upper[i]] = again[upper[i]];
+      ec->stats.tear_retries++;
+    }
+
+  return 0;
+}
+
+/* 
+ * Static field cache 
+ *
+ * Registers that only F_STATIC fields cover are kept in a file and 
+ * served from it as long as PJID and the battery serial BSN0 read the
+ * same as when they were cached, so a one-shot invocation reads only 
+ * the volatile registers plus those three.  --refresh re-reads them.
+ */
+int
+static_reg (unsigned char addr)
+{
+  static unsigned char map[32];
+  static int built = 0;
+  unsigned char volatile_map[32];
+  const struct ec_field *f;
+  int i;
+
+  if (!built)
+    {
+      memset (volatile_map, 0, sizeof (volatile_map));
+      for (f = fields; f->name != NULL; f++)
+        for (i = f->offset; i < f->offset + f->width; i++)
+          if (f->flags & F_STATIC)
+            map[i >> 3] |= 1 << (i & 7);
+          else
+            volatile_map[i >> 3] |= 1 << (i & 7);
+      for (i = 0; i < 32; i++)
+        map[i] &= ~volatile_map[i];
+      built = 1;
+    }
+
+  return (map[addr >> 3] >> (addr & 7)) & 1;
+}
+
+/* 
+ * Serve pending static registers from the cache, returns how many.
+ * They are removed from pending.
+ */
+int
+static_fill (struct ec_session *ec, unsigned char *pending)
+{
+  struct ec_static *c = &ec->statics;
+  int a, n = 0;
+
+  for (a = 0; a < 256; a++)
+    if ((pending[a >> 3] & (1 << (a & 7))) && static_reg (a))
+      break;
+  if (a == 256)
+    return 0;
+
+  if (ec->static_state == 0)
+    static_check (ec);
+  if (ec->static_state < 0)
+    return 0;
+
+  for (; a < 256; a++)
+    if ((pending[a >> 3] & c->valid[a >> 3] & (1 << (a & 7))) 
+        && static_reg (a))
+      {
+        ec->snap.regs[a] = c->regs[a];
+        pending[a >> 3] &= ~(1 << (a & 7));
+        n++;
+      }
+
+  return n;
+}
+
+/* remember static registers just read from the EC */
+void
+static_store (struct ec_session *ec, const unsigned char *pending)
+{
+  struct ec_static *c = &ec->statics;
+  int a;
+
+  for (a = 0; a < 256; a++)
+    if ((pending[a >> 3] & (1 << (a & 7))) && static_reg (a))
+      {
+        c->regs[a] = ec->snap.regs[a];
+        c->valid[a >> 3] |= 1 << (a & 7);
+        ec->static_dirty = 1;
+      }
+}
+
+/* load the cache, usable only if PJID and BSN0 still match */
+void
+static_check (struct ec_session *ec)
+{
+  struct ec_static *c = &ec->statics;
+  const unsigned char keys[] = { 0xbc, 0xc4, 0xc5 };
+  unsigned char image[256];
+  int i, fd;
+
+  ec->static_state = -1;
+  if (read_regs (ec, keys, sizeof (keys), image) < 0)
+    return;
+
+  fd = open (ec->static_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || read (fd, c, sizeof (*c)) != sizeof (*c) 
+      || c->magic != STATIC_MAGIC || ec->refresh)
+    memset (c, 0, sizeof (*c));
+  if (fd != -1)
+    close (fd);
+
+  for (i = 0; i < (int) sizeof (keys); i++)
+    if (c->key[i] != image[keys[i]])
+      {
+        /* other machine or battery swapped */
+        memset (c, 0, sizeof (*c));
+        break;
+      }
+  c->magic = STATIC_MAGIC;
+  for (i = 0; i < (int) sizeof (keys); i++)
+    c->key[i] = image[keys[i]];
+  ec->static_state = 1;
+}
+
+/* write the cache to a temporary file, then rename it into place */
+void
+static_save (struct ec_session *ec)
+{
+  char *tmp;
+  int fd;
+
+  ec->static_dirty = 0;
+  if (asprintf (&tmp, "%s.XXXXXX", ec->static_path) == -1)
+    return;
+
+  if ((fd = mkstemp (tmp)) == -1)
+    {
+      free (tmp);
+      return;
+    }
+  fchmod (fd, 0644);
+  if (write (fd, &ec->statics, sizeof (ec->statics)) 
+      != sizeof (ec->statics) || close (fd) == -1
+      || rename (tmp, ec->static_path) == -1)
+    unlink (tmp);
+  free (tmp);
+}
+
+/* 
+ * Write plan 
+ *
+ * Bit changes are queued as per-register clear and set masks and 
+ * applied together before the next read, at the end of a batch and at
+ * exit: one read pass over the registers involved, then one write per
+ * register in the order they were first queued.  Several commands on
+ * the same register (-b on -w off) thus cost one read and one write,
+ * and nothing of ours runs between them.
+ */
+void
+plan_update (struct ec_session *ec, unsigned char rid, unsigned char clear,
+             unsigned char set)
+{
+  struct ec_plan *p = &ec->plan;
+
+  if (!(p->queued[rid >> 3] & (1 << (rid & 7))))
+    {
+      p->queued[rid >> 3] |= 1 << (rid & 7);
+      p->order[p->n++] = rid;
+      p->clear[rid] = p->set[rid] = p->flip[rid] = 0;
+    }
+  p->clear[rid] = (p->clear[rid] | clear) & ~set;
+  p->set[rid] = (p->set[rid] & ~clear) | set;
+  p->flip[rid] &= ~(clear | set);
+}
+
+/* 
+ * Invert bits of register rid.  Bits the plan already sets or clears 
+ * swap, the others flip against the value read at plan_flush(), under
+ * the lock, so that a toggle never acts on a stale value.
+ */
+void
+plan_toggle (struct ec_session *ec, unsigned char rid, unsigned char bits)
+{
+  struct ec_plan *p = &ec->plan;
+  unsigned char forced, clear;
+
+  plan_update (ec, rid, 0, 0);
+  forced = bits & (p->clear[rid] | p->set[rid]);
+  clear = p->clear[rid];
+  p->clear[rid] = (clear & ~forced) | (p->set[rid] & forced);
+  p->set[rid] = (p->set[rid] & ~forced) | (clear & forced);
+  p->flip[rid] ^= bits & ~forced;
+}
+
+/* print the state of switch bits once the plan is written */
+void
+plan_notify (struct ec_session *ec, unsigned char rid, unsigned char bits)
+{
+  ec->plan.notify[rid] |= bits;
+}
+
+/* "X is now on." for each switch the plan has changed */
+void
+plan_report (struct ec_session *ec, const unsigned char *regs)
+{
+  const struct ec_switch *sw;
+
+  for (sw = switches; sw->name != NULL; sw++)
+    if (ec->plan.notify[sw->reg] & sw->bit && !quiet)
+      printf ("%s is now %s.\n", sw->label, 
+              !(regs[sw->reg] & sw->bit) == !sw->inverted ? "off" : "on");
+}
+
+int
+plan_flush (struct ec_session *ec)
+{
+  struct ec_plan *p = &ec->plan;
+  unsigned char expect[256];
+  int i, n = p->n, rid, err;
+
+  if (n == 0)
+    return 0;
+
+  /* 
+   * Nobody else may write these between our read and write.  Values
+   * read before the lock may be stale, read them again; registers 
+   * written as a whole need not be read.
+   */
+  ec_lock (ec);
+  if (ec->backend->update != NULL)
+    {
+      /* the backend (the broker) reads and writes under its own lock */
+      for (i = 0; i < n; i++)
+        {
+          rid = p->order[i];
+          if ((err = ec->backend->update (ec, rid, p->clear[rid], 
+                                          p->set[rid], p->flip[rid])) < 0)
+            goto out;
+          expect[rid] = err;
+          snap_invalidate (&ec->snap, rid);
+          ec->stats.transactions++;
+          ec->stats.bytes_written++;
+        }
+      err = 0;
+    }
+  else
+    {
+      for (i = 0; i < n; i++)
+        if ((p->clear[p->order[i]] | p->set[p->order[i]]) != 0xff)
+          {
+            snap_invalidate (&ec->snap, p->order[i]);
+            snap_want (&ec->snap, p->order[i]);
+          }
+      if ((err = snap_read (ec)) < 0)
+        goto out;
+
+      for (i = 0; i < n; i++)
+        {
+          rid = p->order[i];
+          expect[rid] = ((ec->snap.regs[rid] & ~p->clear[rid]) 
+                         | p->set[rid]) ^ p->flip[rid];
+          if ((err = set_reg (ec, rid, expect[rid])) < 0)
+            goto out;
+        }
+    }
+
+  if (ec->verify)
+    {
+      for (i = 0; i < n; i++)
+        snap_want (&ec->snap, p->order[i]);
+      if ((err = snap_read (ec)) < 0)
+        goto out;
+      for (i = 0; i < n; i++)
+        if (ec->snap.regs[p->order[i]] != expect[p->order[i]])
+          {
+            ec->error_reg = p->order[i];
+            err = -EC_EVERIFY;
+            goto out;
+          }
+    }
+
+ out:
+  ec_unlock (ec);
+  if (err >= 0)
+    plan_report (ec, expect);
+  p->n = 0;
+  memset (p->queued, 0, sizeof (p->queued));
+  memset (p->notify, 0, sizeof (p->notify));
+
+  return err;
+}
+
+/* 
+ * Enter burst mode.  An EC without burst support either answers 
+ * something else than EC_BURST_ACK or nothing at all; remember that 
+ * and stay in byte mode.  An EC that acks too late may still go into
+ * burst, so on failure drain OBF and send BD_EC: neither its ack nor
+ * burst mode may outlive this call.
+ */
+int
+burst_enable (struct ec_session *ec)
+{
+  int r;
+
+  ec->deadline = monotonic_ns () + ec->timeout;
+  if (write_port (ec, BE_EC, EC_SC) < 0)
+    {
+      recover (ec);
+      burst_disable (ec);
+      return -1;
+    }
+
+  ec->deadline = monotonic_ns () + BURST_ACK_TIMEOUT;
+  if ((r = read_port (ec, EC_DATA)) != EC_BURST_ACK)
+    {
+      recover (ec);
+      burst_disable (ec);
+      ec->no_burst = 1;
+      return -1;
+    }
+  ec->in_burst = 1;
+  ec->stats.bursts++;
+
+  return 0;
+}
+
+void
+burst_disable (struct ec_session *ec)
+{
+  ec->deadline = monotonic_ns () + ec->timeout;
+  if (write_port (ec, BD_EC, EC_SC) < 0)
+    recover (ec);
+  ec->in_burst = 0;
+}
+
+const char *
+ec_strerror (int err)
+{
+  switch (-err)
+    {
+    case EC_ETIMEDOUT:
+      return "EC timed out";
+    case EC_EIO:
+      return "EC I/O error";
+    case EC_EPERM:
+      return "permission denied";
+    case EC_EVERIFY:
+      return "write did not take effect";
+    }
+
+  return "unknown error";
+}
+
+/* print a failed command, returns the exit status */
+int
+report (struct ec_session *ec, int err)
+{
+  if (err >= 0)
+    return EXIT_SUCCESS;
+
+  fprintf (stderr, "Error accessing register 0x%02x: %s\n", 
+           ec->error_reg, ec_strerror (err));
+  return EXIT_FAILURE;
+}
+
+/* open session on first use */
+struct ec_session *
+open_ec (struct ec_session *ec)
+{
+  if (!ec->opened)
+    init_port (ec);
+
+  return ec;
+}
+
+void
+init_port (struct ec_session *ec)
+{
+  long long start = monotonic_ns ();
+
+  if (ec->auto_backend && broker_open (ec) == 0)
+    ec->backend = find_backend ("broker");
+  else if (ec->auto_backend && ecsys_open (ec) == 0)
+    ec->backend = find_backend ("ecsys");
+  else if (ec->backend->open (ec) == -1)
+    {
+      perror ("Error opening port");
+      exit (EXIT_FAILURE);
+    }
+  ec->opened = 1;
+  poll_load (&ec->poll);
+  if (ec->trace_path)
+    trace_start (ec);
+
+  /* the emulator and replays have no machine to cache for */
+  if (ec->static_path == NULL && ec->backend->open != emul_open
+      && ec->backend->open != replay_open)
+    ec->static_path = STATIC_CACHE;
+  if (ec->static_path != NULL && *ec->static_path == '\0')
+    ec->static_path = NULL;
+  lock_open (ec);
+
+  if (ec->drop_privileges)
+    drop_privileges ();
+  ec->stats.init_ns = monotonic_ns () - start;
+}
+
+void
+close_port (struct ec_session *ec)
+{
+  if (!ec->opened)
+    return;
+
+  if (ec->in_burst)
+    burst_disable (ec);
+  if (ec->tracer)
+    trace_stop (ec);
+  if (ec->static_dirty)
+    static_save (ec);
+
+  ec->backend->close (ec);
+  if (ec->lock_fd != -1)
+    close (ec->lock_fd);
+  ec->lock_fd = -1;
+  ec->opened = 0;
+  poll_save (&ec->poll);
+}
+
+/* 
+ * Give up root once port access is granted.  I/O permissions survive 
+ * setuid(), so the session stays usable.  Under sudo, switch to the 
+ * invoking user, otherwise to nobody.
+ */
+void
+drop_privileges (void)
+{
+  uid_t uid = getuid ();
+  gid_t gid = getgid ();
+  char *sudo_uid = getenv ("SUDO_UID");
+  char *sudo_gid = getenv ("SUDO_GID");
+
+  if (uid != 0)
+    ;
+  else if (sudo_uid && sudo_gid)
+    {
+      uid = atoi (sudo_uid);
+      gid = atoi (sudo_gid);
+    }
+  else
+    uid = gid = 65534;
+
+  if (setgroups (0, NULL) == -1 && errno != EPERM)
+    {
+      perror ("Error dropping privileges");
+      exit (EXIT_FAILURE);
+    }
+
+  if (setgid (gid) == -1 || setuid (uid) == -1)
+    {
+      perror ("Error dropping privileges");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* 
+ * Wait until (status & mask) == want.  Spin for the calibrated window 
+ * first, a responsive EC answers within a few microseconds; sleep with
+ * exponential backoff after that.
+ */
+int
+wait_port (struct ec_session *ec, unsigned char mask, unsigned char want)
+{
+  struct ec_poll *p = &ec->poll;
+  long long start = 0, now;
+  long delay = p->sleep_min;
+  struct timespec ts;
+
+  while ((ec->backend->in (ec, EC_SC) & mask) != want)
+    {
+      now = monotonic_ns ();
+      if (start == 0)
+        start = now;
+      if (now >= ec->deadline)
+        return -EC_ETIMEDOUT;
+
+      if (now - start < p->spin)
+        {
+          ec->stats.spins++;
+          cpu_relax ();
+          continue;
+        }
+
+      if (delay > ec->deadline - now)
+        delay = ec->deadline - now;
+      ts.tv_sec = delay / 1000000000L;
+      ts.tv_nsec = delay % 1000000000L;
       nanosleep (&ts, NULL);
+      ec->stats.sleeps++;
+      ec->stats.syscalls++;
+      delay = delay * 2 > p->sleep_max ? p->sleep_max : delay * 2;
+    }
+
+  now = start ? monotonic_ns () - start : 0;
+  hist_add (mask == EC_IBF ? &ec->stats.ibf : &ec->stats.obf, now);
+  if (start == 0 || !p->learn)
+    return 0;
+
+  /* moving average of response time, spin window covers twice that */
+  p->typical = p->typical ? p->typical + (now - p->typical) / 8 : now;
+  p->spin = 2 * p->typical;
+  if (p->spin > POLL_SPIN_MAX)
+    p->spin = POLL_SPIN_MAX;
+
+  return 0;
+}
+
+int
+read_port (struct ec_session *ec, unsigned char port)
+{
+  /* check if port is available for read */
+  if (wait_port (ec, EC_OBF, EC_OBF) < 0)
+    return -EC_ETIMEDOUT;
+
+  return ec->backend->in (ec, port);
+}
+
+int
+write_port (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  /* check if port is available for write */
+  if (wait_port (ec, EC_IBF, 0) < 0)
+    return -EC_ETIMEDOUT;
+
+  ec->backend->out (ec, data, port);
+  return 0;
+}
+
+/* 
+ * --poll=spin=US,sleep=US,max=US,file=PATH,fixed 
+ */
+void
+poll_options (struct ec_poll *p, char *arg)
+{
+  enum { SPIN, SLEEP, MAX, FILE_, FIXED };
+  char *const tokens[] = { "spin", "sleep", "max", "file", "fixed", NULL };
+  char *value;
+
+  while (*arg != '\0')
+    {
+      switch (getsubopt (&arg, tokens, &value))
+        {
+        case SPIN:
+          p->spin = value ? atol (value) * 1000 : 0;
+          p->learn = 0;
+          break;
+        case SLEEP:
+          p->sleep_min = value ? atol (value) * 1000 : POLL_SLEEP_MIN;
+          break;
+        case MAX:
+          p->sleep_max = value ? atol (value) * 1000 : POLL_SLEEP_MAX;
+          break;
+        case FILE_:
+          p->file = value;
+          break;
+        case FIXED:
+          p->learn = 0;
+          break;
+        default:
+          fprintf (stderr, "Unknown poll option: %s\n", value);
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  if (p->sleep_min <= 0)
+    p->sleep_min = 1000;
+  if (p->sleep_max < p->sleep_min)
+    p->sleep_max = p->sleep_min;
+}
+
+void
+poll_load (struct ec_poll *p)
+{
+  FILE *f;
+  long typical;
+
+  if (p->file == NULL || (f = fopen (p->file, "r")) == NULL)
+    return;
+
+  if (fscanf (f, "%ld", &typical) == 1 && typical > 0 && p->learn)
+    {
+      p->typical = typical;
+      p->spin = 2 * typical < POLL_SPIN_MAX ? 2 * typical : POLL_SPIN_MAX;
+    }
+  fclose (f);
+}
+
+void
+poll_save (struct ec_poll *p)
+{
+  FILE *f;
+
+  if (p->file == NULL || !p->learn || p->typical == 0)
+    return;
+
+  if ((f = fopen (p->file, "w")) == NULL)
+    return;
+
+  fprintf (f, "%ld\n", p->typical);
+  fclose (f);
+}
+
+const struct ec_backend *
+find_backend (const char *name)
+{
+  const struct ec_backend *b;
+
+  for (b = backends; b->name != NULL; b++)
+    if (strcmp (b->name, name) == 0)
+      return b;
+
+  return NULL;
+}
+
+long long
+monotonic_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+cpu_relax (void)
+{
+#if defined (__i386__) || defined (__x86_64__)
+  __asm__ __volatile__ ("pause");
+#endif
+}
+
+/* 
+ * Raw port backend, needs root 
+ */
+int
+port_open (struct ec_session *ec)
+{
+  ec->stats.syscalls++;
+  if (ioperm (EC_SC, 1, 1) == -1)
+    return -1;
+
+  ec->stats.syscalls++;
+  if (ioperm (EC_DATA, 1, 1) == -1)
+    return -1;
+
+  return 0;
+}
+
+void
+port_close (struct ec_session *ec)
+{
+  ioperm (EC_SC, 1, 0);
+  ioperm (EC_DATA, 1, 0);
+  ec->stats.syscalls += 2;
+}
+
+unsigned char
+port_in (struct ec_session *ec, unsigned char port)
+{
+  (void) ec;
+  return inb (port);
+}
+
+void
+port_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  (void) ec;
+  outb (data, port);
+}
+
+/* 
+ * /dev/port backend 
+ *
+ * Same port protocol as the raw backend, but through pread/pwrite on 
+ * a descriptor opened once, for systems where ioperm() is not 
+ * available (non-x86, seccomp, lockdown).  Every status poll is one 
+ * pread; the protocol needs the status between bytes, so accesses 
+ * cannot be merged.  Only a character device will do: a mistyped 
+ * path to a regular file must not pass for the EC.
+ */
+int
+devport_open (struct ec_session *ec)
+{
+  struct stat st;
+
+  ec->fd = open (ec->devport_path, O_RDWR | O_CLOEXEC);
+  if (ec->fd == -1)
+    return -1;
+  if (fstat (ec->fd, &st) == -1 || !S_ISCHR (st.st_mode))
+    {
+      close (ec->fd);
+      ec->fd = -1;
+      errno = ENODEV;
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+devport_close (struct ec_session *ec)
+{
+  close (ec->fd);
+  ec->fd = -1;
+}
+
+unsigned char
+devport_in (struct ec_session *ec, unsigned char port)
+{
+  unsigned char data = 0xff;
+
+  ec->stats.syscalls++;
+  if (pread (ec->fd, &data, 1, port) != 1)
+    return port == EC_SC ? EC_IBF : 0xff;
+
+  return data;
+}
+
+void
+devport_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  ec->stats.syscalls++;
+  pwrite (ec->fd, &data, 1, port);
+}
+
+/* 
+ * ec_sys backend 
+ *
+ * The ec_sys module exposes the register file as a 256 byte debugfs 
+ * file.  Reads go through the kernel EC driver and its locking instead
+ * of racing it on the ports.  Nearby registers are merged into one 
+ * pread, writes need ec_sys write_support=1.
+ */
+int
+ecsys_open (struct ec_session *ec)
+{
+  ec->fd = open (ec->ecsys_path, O_RDWR | O_CLOEXEC);
+  /* chosen by itself, leave writes to port I/O rather than fail them */
+  if (ec->fd == -1 && !(ec->auto_backend && ec->writes))
+    ec->fd = open (ec->ecsys_path, O_RDONLY | O_CLOEXEC);
+
+  return ec->fd == -1 ? -1 : 0;
+}
+
+void
+ecsys_close (struct ec_session *ec)
+{
+  close (ec->fd);
+  ec->fd = -1;
+}
+
+int
+ecsys_read (struct ec_session *ec, const unsigned char *addrs, int n, 
+            unsigned char *regs)
+{
+  int i, j;
+  ssize_t len;
+
+  for (i = 0; i < n; i = j)
+    {
+      for (j = i + 1; j < n && addrs[j] - addrs[j - 1] <= ECSYS_GAP; j++)
+        ;
+
+      len = addrs[j - 1] - addrs[i] + 1;
+      ec->stats.syscalls++;
+      if (pread (ec->fd, regs + addrs[i], len, addrs[i]) != len)
+        {
+          ec->error_reg = addrs[i];
+          return -EC_EIO;
+        }
+    }
+
+  return 0;
+}
+
+int
+ecsys_write (struct ec_session *ec, unsigned char addr, unsigned char data)
+{
+  ec->stats.syscalls++;
+  if (pwrite (ec->fd, &data, 1, addr) != 1)
+    {
+      ec->error_reg = addr;
+      return (errno == EPERM || errno == EACCES || errno == EBADF) 
+             ? -EC_EPERM : -EC_EIO;
+    }
+
+  return 0;
+}
+
+/* 
+ * Software EC backend 
+ *
+ * Implements the ACPI EC command set (RD_EC, WR_EC, BE_EC, BD_EC) over 
+ * a 256-byte register file.  Each byte written keeps IBF set for the
+ * configured latency, a reply byte shows up in OBF afterwards.
+ */
+
+/* Register image resembling an AOD150 on AC power */
+static const unsigned char emul_image[256] =
+  {
+    [0x9f] = 0x02,              /* lid open */
+    [0xa3] = 0x20,              /* adapter present */
+    [0xa7] = 80,                /* passive trip point */
+    [0xa8] = 95,                /* critical trip point */
+    [0xb0] = 45,                /* CPU temp */
+    [0xb1] = 40,
+    [0xb2] = 38, [0xb3] = 37, [0xb4] = 36, [0xb5] = 35,
+    [0xb9] = 5,                 /* brightness */
+    [0xbb] = 0x0d,              /* wlan on, wlan and bt present */
+    [0xbc] = 0x01,              /* PJID */
+    [0xbd] = 0x01,              /* CPUN */
+    [0xc0] = 0x10,
+    [0xc1] = 0x02,              /* charging */
+    [0xc2] = 0x66, [0xc3] = 0x08, /* 2150 mAh */
+    [0xc4] = 0x34, [0xc5] = 0x12, /* serial */
+    [0xc6] = 0x76, [0xc7] = 0x2f, /* 12150 mV */
+    [0xc8] = 0x5c, [0xc9] = 0x2b, /* 11100 mV */
+    [0xca] = 0x98, [0xcb] = 0x08, /* 2200 mAh */
+    [0xcc] = 0x92, [0xcd] = 0x09, /* 2450 mAh */
+    [0xce] = 85,                /* gauge */
+    [0xd2] = 0x00, [0xd3] = 0x04,
+    [0xf4] = 0x29, [0xf5] = 0x3b, /* manufacture date */
+  };
+
+int
+emul_open (struct ec_session *ec)
+{
+  static int booted = 0;
+
+  if (!booted)
+    {
+      memcpy (emul.regs, emul_image, sizeof (emul.regs));
+      if (emul.latency == 0 && emul.burst_latency == 0)
+        {
+          emul.latency = EMUL_LATENCY;
+          emul.burst_latency = EMUL_BURST_LATENCY;
+        }
+      booted = 1;
+    }
+  ec->priv = &emul;
+
+  return 0;
+}
+
+void
+emul_close (struct ec_session *ec)
+{
+  ec->priv = NULL;
+}
+
+/* 
+ * Synthetic events, every --emul=event=MS: the lid and the power 
+ * adapter (with the battery status) change in turn, query numbers 
+ * 0x01 and 0x02 are queued for QR_EC and SCI_EVT is raised.
+ */
+void
+emul_tick (struct ec_emul *e)
+{
+  long long now = monotonic_ns ();
+
+  if (e->event && now >= e->next_event)
+    {
+      if (e->next_event != 0 && e->events++ % 2 == 0)
+        {
+          e->regs[0x9f] ^= 0x02;
+          e->query = 0x01;
+        }
+      else if (e->next_event != 0)
+        {
+          e->regs[0xa3] ^= 0x20;
+          e->regs[0xc1] = (e->regs[0xa3] & 0x20) ? 0x02 : 0x01;
+          e->query = 0x02;
+        }
+      if (e->next_event != 0)
+        e->status |= EC_SCI_EVT;
+      e->next_event = now + e->event;
+    }
+
+  if (now < e->ready)
+    return;
+
+  e->status &= ~EC_IBF;
+  if (e->pending)
+    {
+      e->status |= EC_OBF;
+      e->pending = 0;
+    }
+}
+
+void
+emul_reply (struct ec_emul *e, unsigned char data)
+{
+  e->data = data;
+  e->pending = 1;
+}
+
+unsigned char
+emul_in (struct ec_session *ec, unsigned char port)
+{
+  struct ec_emul *e = ec->priv;
+
+  emul_tick (e);
+  if (port == EC_SC)
+    return e->status;
+
+  e->status &= ~EC_OBF;
+  return e->data;
+}
+
+void
+emul_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  struct ec_emul *e = ec->priv;
+  long latency;
+  int v;
+
+  emul_tick (e);
+  latency = (e->status & EC_BURST) ? e->burst_latency : e->latency;
+  e->status |= EC_IBF;
+  e->ready = monotonic_ns () + latency;
+
+  if (port == EC_SC)
+    {
+      e->status |= EC_CMD;
+      e->cmd = data;
+      e->phase = 0;
+      if (e->churn && !(e->status & EC_BURST))
+        {
+          /* battery counter moving under the host, frozen in burst */
+          v = e->regs[0xc2] + e->regs[0xc3] * 256 + e->churn;
+          e->regs[0xc2] = v & 0xff;
+          e->regs[0xc3] = (v >> 8) & 0xff;
+        }
+      if (e->drop && ++e->commands % e->drop == 0)
+        {
+          e->cmd = 0;
+          return;
+        }
+      switch (data)
+        {
+        case BE_EC:
+          if (e->no_burst)
+            {
+              e->cmd = 0;
+              break;
+            }
+          e->status |= EC_BURST;
+          emul_reply (e, EC_BURST_ACK);
+          e->cmd = 0;
+          break;
+        case BD_EC:
+          e->status &= ~EC_BURST;
+          e->cmd = 0;
+          break;
+        case QR_EC:
+          e->status &= ~EC_SCI_EVT;
+          emul_reply (e, e->query);
+          e->query = 0;
+          e->cmd = 0;
+          break;
+        }
+      return;
+    }
+
+  e->status &= ~EC_CMD;
+  switch (e->cmd)
+    {
+    case RD_EC:
+      emul_reply (e, e->regs[data]);
+      e->cmd = 0;
+      break;
+    case WR_EC:
+      if (e->phase++ == 0)
+        e->addr = data;
+      else
+        {
+          e->regs[e->addr] = data;
+          e->cmd = 0;
+        }
+      break;
+    }
+}
+
+/* 
+ * --emul=latency=NS,burst=NS,noburst,drop=N,churn=N,event=MS
+ */
+void
+emul_options (char *arg)
+{
+  enum { LATENCY, BURST, NOBURST, DROP, CHURN, EVENT };
+  char *const tokens[] = 
+    { "latency", "burst", "noburst", "drop", "churn", "event", NULL };
+  char *value;
+
+  while (*arg != '\0')
+    {
+      switch (getsubopt (&arg, tokens, &value))
+        {
+        case LATENCY:
+          emul.latency = value ? atol (value) : 0;
+          if (emul.burst_latency == 0)
+            emul.burst_latency = emul.latency;
+          break;
+        case BURST:
+          emul.burst_latency = value ? atol (value) : 0;
+          break;
+        case NOBURST:
+          emul.no_burst = 1;
+          break;
+        case DROP:
+          emul.drop = value ? atoi (value) : 0;
+          break;
+        case CHURN:
+          emul.churn = value ? atoi (value) : 0;
+          break;
+        case EVENT:
+          emul.event = value ? atol (value) * 1000000L : 0;
+          break;
+        default:
+          fprintf (stderr, "Unknown emulator option: %s\n", value);
+          exit (EXIT_FAILURE);
+        }
+    }
+}
+
+/* 
+ * Port trace 
+ *
+ * --trace=FILE appends every in/out of the port backend, with the time
+ * since the previous one, as 8 byte records.  Records are buffered and
+ * written TRACE_BUFFER at a time.
+ */
+void
+trace_start (struct ec_session *ec)
+{
+  struct ec_tracer *t;
+
+  if (ec->backend->in == NULL)
+    {
+      fprintf (stderr, "Cannot trace the %s backend\n", ec->backend->name);
+      exit (EXIT_FAILURE);
+    }
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    {
+      perror ("Error allocating trace buffer");
+      exit (EXIT_FAILURE);
+    }
+  t->fd = open (ec->trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                0644);
+  if (t->fd == -1)
+    {
+      perror ("Error opening trace file");
+      exit (EXIT_FAILURE);
+    }
+
+  t->inner = ec->backend;
+  t->backend = *ec->backend;
+  t->backend.in = trace_in;
+  t->backend.out = trace_out;
+  ec->backend = &t->backend;
+  ec->tracer = t;
+
+  t->buf[0].delta = TRACE_MAGIC;
+  t->buf[0].op = TRACE_START;
+  t->buf[0].port = TRACE_VERSION;
+  t->n = 1;
+  t->last = monotonic_ns ();
+}
+
+void
+trace_stop (struct ec_session *ec)
+{
+  struct ec_tracer *t = ec->tracer;
+
+  trace_flush (t);
+  close (t->fd);
+  ec->backend = t->inner;
+  ec->tracer = NULL;
+  free (t);
+}
+
+void
+trace_flush (struct ec_tracer *t)
+{
+  if (t->n > 0 && write (t->fd, t->buf, t->n * sizeof (t->buf[0])) == -1)
+    perror ("Error writing trace");
+  t->n = 0;
+}
+
+void
+trace_log (struct ec_session *ec, int op, unsigned char port, 
+           unsigned char data)
+{
+  struct ec_tracer *t = ec->tracer;
+  struct ec_trace *r;
+  long long now = monotonic_ns ();
+
+  if (t->n == TRACE_BUFFER)
+    trace_flush (t);
+  r = &t->buf[t->n++];
+  r->delta = now - t->last > UINT32_MAX ? UINT32_MAX : now - t->last;
+  r->op = op;
+  r->port = port;
+  r->data = data;
+  r->pad = 0;
+  t->last = now;
+}
+
+unsigned char
+trace_in (struct ec_session *ec, unsigned char port)
+{
+  unsigned char data = ec->tracer->inner->in (ec, port);
+
+  trace_log (ec, TRACE_IN, port, data);
+  return data;
+}
+
+void
+trace_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  ec->tracer->inner->out (ec, data, port);
+  trace_log (ec, TRACE_OUT, port, data);
+}
+
+/* 
+ * Replay backend 
+ *
+ * --replay=FILE answers port reads from a trace, paced at the recorded
+ * speed.  The commands must issue the same writes as the recording, 
+ * the number of status polls may differ: polls the recording has on 
+ * top are skipped, polls it lacks are answered with a ready status.  
+ * At the end of the trace it starts over, so a recorded --watch can 
+ * run on.
+ */
+int
+replay_open (struct ec_session *ec)
+{
+  struct ec_replay *r;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (ec->replay_path == NULL)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+  if ((fd = open (ec->replay_path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+  if (fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (struct ec_trace))
+    {
+      close (fd);
+      errno = EINVAL;
+      return -1;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  r = calloc (1, sizeof (*r));
+  if (r == NULL)
+    {
+      perror ("Error allocating replay state");
+      exit (EXIT_FAILURE);
+    }
+  r->rec = map;
+  r->n = st.st_size / sizeof (struct ec_trace);
+  if (r->rec[0].op != TRACE_START || r->rec[0].delta != TRACE_MAGIC
+      || r->rec[0].port != TRACE_VERSION)
+    {
+      munmap (map, st.st_size);
+      free (r);
+      errno = EINVAL;
+      return -1;
+    }
+  r->start = monotonic_ns ();
+  ec->priv = r;
+
+  return 0;
+}
+
+void
+replay_close (struct ec_session *ec)
+{
+  struct ec_replay *r = ec->priv;
+
+  munmap ((void *) r->rec, r->n * sizeof (struct ec_trace));
+  free (r);
+  ec->priv = NULL;
+}
+
+/* next port operation, session markers skipped */
+const struct ec_trace *
+replay_next (struct ec_session *ec)
+{
+  struct ec_replay *r = ec->priv;
+
+  while (r->pos < r->n && r->rec[r->pos].op == TRACE_START)
+    r->pos++;
+
+  return r->pos < r->n ? &r->rec[r->pos] : NULL;
+}
+
+/* consume the next operation, once it is due if pace is set */
+void
+replay_take (struct ec_session *ec, int pace)
+{
+  struct ec_replay *r = ec->priv;
+  struct timespec ts;
+  long long due;
+
+  r->at += r->rec[r->pos++].delta;
+  due = r->start + r->at;
+  if (pace && due > monotonic_ns ())
+    {
+      ts.tv_sec = due / 1000000000LL;
+      ts.tv_nsec = due % 1000000000LL;
+      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) 
+             == EINTR)
+        ;
+    }
+}
+
+int
+replay_poll (const struct ec_trace *t)
+{
+  return t != NULL && t->op == TRACE_IN && t->port == EC_SC;
+}
+
+unsigned char
+replay_in (struct ec_session *ec, unsigned char port)
+{
+  struct ec_replay *r = ec->priv;
+  const struct ec_trace *t;
+  long long now = monotonic_ns ();
+
+  /* 
+   * Status polls the recording made and we do not: all of them before
+   * a data read, those already past when polling ourselves, except the
+   * last one.
+   */
+  while (replay_poll (t = replay_next (ec))
+         && (port == EC_DATA 
+             || (r->pos + 1 < r->n && replay_poll (&r->rec[r->pos + 1])
+                 && r->start + r->at + t->delta <= now)))
+    replay_take (ec, 0);
+
+  if (t != NULL && t->op == TRACE_IN && t->port == port)
+    {
+      replay_take (ec, 1);
+      return t->data;
+    }
+  if (port == EC_SC)
+    return t != NULL && t->op == TRACE_IN ? EC_OBF : 0;
+
+  fprintf (stderr, "Replay diverges from the trace at record %lu\n", 
+           (unsigned long) r->pos);
+  exit (EXIT_FAILURE);
+}
+
+void
+replay_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  struct ec_replay *r = ec->priv;
+  const struct ec_trace *t;
+
+  while (replay_poll (t = replay_next (ec)))
+    replay_take (ec, 0);
+
+  if (t == NULL)
+    {
+      /* start over */
+      r->pos = 0;
+      r->at = 0;
+      r->start = monotonic_ns ();
+      while (replay_poll (t = replay_next (ec)))
+        replay_take (ec, 0);
+    }
+
+  if (t == NULL || t->op != TRACE_OUT || t->port != port || t->data != data)
+    {
+      fprintf (stderr, "Replay diverges from the trace at record %lu\n", 
+               (unsigned long) r->pos);
+      exit (EXIT_FAILURE);
+    }
+  replay_take (ec, 1);
+}
+
+/* 
+ * EC broker 
+ *
+ * acer-ec --serve owns the only EC session and answers requests from 
+ * other acer-ec processes over a local socket.  Reads arriving together
+ * are merged into one snapshot pass, registers younger than the cache 
+ * TTL are answered without EC traffic.  Each client's writes are applied
+ * in the order it sent them; read-modify-writes are done here, against
+ * the live register, so that clients cannot lose each other's changes.
+ * Only root and the broker's own user may write.
+ */
+int
+serve (struct ec_session *ec)
+{
+  struct sockaddr_un sun;
+  struct pollfd pfd[1 + BROKER_CLIENTS];
+  struct ec_request req;
+  struct ec_reply reply;
+  struct ucred cred;
+  socklen_t len;
+  uid_t uid[1 + BROKER_CLIENTS];
+  unsigned char want[1 + BROKER_CLIENTS][32], stale[32];
+  int pending[1 + BROKER_CLIENTS];
+  long long stamp[256], now;
+  int i, a, r, fd, nfds, nreads, err = 0;
+
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strncpy (sun.sun_path, ec->socket, sizeof (sun.sun_path) - 1);
+
+  /* a socket nobody answers on is left over, a live one is not ours */
+  fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd != -1 && connect (fd, (struct sockaddr *) &sun, sizeof (sun)) == 0)
+    {
+      fprintf (stderr, "A broker is already running on %s\n", ec->socket);
+      exit (EXIT_FAILURE);
+    }
+  unlink (ec->socket);
+  if (fd == -1 || bind (fd, (struct sockaddr *) &sun, sizeof (sun)) == -1 
+      || chmod (ec->socket, 0666) == -1 || listen (fd, 16) == -1)
+    {
+      perror ("Error creating broker socket");
+      exit (EXIT_FAILURE);
+    }
+
+  memset (stamp, 0, sizeof (stamp));
+  pfd[0].fd = fd;
+  pfd[0].events = POLLIN;
+  nfds = 1;
+  catch_signals ();
+
+  while (!interrupted)
+    {
+      /* the last client takes the slot of one that is gone */
+      for (i = nfds - 1; i > 0; i--)
+        if (pfd[i].fd == -1)
+          {
+            pfd[i] = pfd[--nfds];
+            uid[i] = uid[nfds];
+          }
+
+      stats_poll (ec);
+      if (poll (pfd, nfds, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          perror ("Error polling broker socket");
+          err = -EC_EIO;
+          break;
+        }
+
+      if ((pfd[0].revents & POLLIN) 
+          && (i = accept4 (fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+        {
+          len = sizeof (cred);
+          if (nfds == 1 + BROKER_CLIENTS 
+              || getsockopt (i, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+            close (i);
+          else
+            {
+              pfd[nfds].fd = i;
+              pfd[nfds].events = POLLIN;
+              pfd[nfds].revents = 0;
+              uid[nfds++] = cred.uid;
+            }
+        }
+
+      /* writes right away, in order; collect reads */
+      memset (ec->snap.want, 0, sizeof (ec->snap.want));
+      memset (stale, 0, sizeof (stale));
+      now = monotonic_ns ();
+      for (i = nfds - 1, nreads = 0; i > 0; i--)
+        {
+          pending[i] = 0;
+          if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+          if (recv (pfd[i].fd, &req, sizeof (req), 0) != sizeof (req))
+            {
+              close (pfd[i].fd);
+              pfd[i].fd = -1;
+              continue;
+            }
+
+          if (req.op == BROKER_WRITE)
+            {
+              memset (&reply, 0, sizeof (reply));
+              if (uid[i] != 0 && uid[i] != getuid ())
+                reply.err = -EC_EPERM;
+              else
+                reply.err = set_reg (ec, req.addr, req.data);
+              reply.error_reg = req.addr;
+              serve_reply (&pfd[i], &reply);
+              continue;
+            }
+
+          if (req.op == BROKER_UPDATE)
+            {
+              memset (&reply, 0, sizeof (reply));
+              ec_lock (ec);
+              if (uid[i] != 0 && uid[i] != getuid ())
+                reply.err = -EC_EPERM;
+              else if ((req.clear | req.set) == 0xff)
+                r = req.set;
+              else if ((reply.err = r = get_reg (ec, req.addr)) > 0)
+                reply.err = 0;
+              if (reply.err == 0)
+                {
+                  r = ((r & ~req.clear) | req.set) ^ req.flip;
+                  reply.err = set_reg (ec, req.addr, r);
+                  reply.regs[req.addr] = r;
+                }
+              ec_unlock (ec);
+              reply.error_reg = req.addr;
+              serve_reply (&pfd[i], &reply);
+              continue;
+            }
+
+          memcpy (want[i], req.want, sizeof (want[i]));
+          for (a = 0; a < 256; a++)
+            if (req.want[a >> 3] & (1 << (a & 7)))
+              {
+                snap_want (&ec->snap, a);
+                if (now - stamp[a] > ec->cache_ttl)
+                  {
+                    snap_invalidate (&ec->snap, a);
+                    stale[a >> 3] |= 1 << (a & 7);
+                  }
+              }
+          pending[i] = 1;
+          nreads++;
+        }
+
+      if (nreads == 0)
+        continue;
+
+      /* one pass for every reader */
+      memset (&reply, 0, sizeof (reply));
+      reply.err = snap_fill (ec);
+      reply.error_reg = ec->error_reg;
+      memcpy (reply.regs, ec->snap.regs, sizeof (reply.regs));
+      for (a = 0; a < 256 && reply.err == 0; a++)
+        if (stale[a >> 3] & (1 << (a & 7)))
+          stamp[a] = now;
+
+      for (i = 1; i < nfds; i++)
+        if (pending[i])
+          serve_reply (&pfd[i], &reply);
+    }
+
+  for (i = 0; i < nfds; i++)
+    if (pfd[i].fd != -1)
+      close (pfd[i].fd);
+  unlink (ec->socket);
+
+  return err;
+}
+
+/* 
+ * Anyone may connect, so a client that does not read its replies is 
+ * dropped rather than waited for: the broker never blocks in send().
+ */
+void
+serve_reply (struct pollfd *pfd, const struct ec_reply *reply)
+{
+  if (send (pfd->fd, reply, sizeof (*reply), MSG_DONTWAIT | MSG_NOSIGNAL)
+      != sizeof (*reply))
+    {
+      close (pfd->fd);
+      pfd->fd = -1;
+    }
+}
+
+int
+broker_open (struct ec_session *ec)
+{
+  struct sockaddr_un sun;
+
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strncpy (sun.sun_path, ec->socket, sizeof (sun.sun_path) - 1);
+
+  ec->fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ec->fd == -1)
+    return -1;
+
+  if (connect (ec->fd, (struct sockaddr *) &sun, sizeof (sun)) == -1)
+    {
+      close (ec->fd);
+      ec->fd = -1;
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+broker_close (struct ec_session *ec)
+{
+  close (ec->fd);
+  ec->fd = -1;
+}
+
+int
+broker_call (struct ec_session *ec, struct ec_request *req, 
+             struct ec_reply *reply)
+{
+  if (send (ec->fd, req, sizeof (*req), MSG_NOSIGNAL) != sizeof (*req)
+      || recv (ec->fd, reply, sizeof (*reply), 0) != sizeof (*reply))
+    {
+      ec->error_reg = req->addr;
+      return -EC_EIO;
+    }
+
+  if (reply->err < 0)
+    ec->error_reg = reply->error_reg;
+
+  return reply->err;
+}
+
+int
+broker_read (struct ec_session *ec, const unsigned char *addrs, int n, 
+             unsigned char *regs)
+{
+  struct ec_request req;
+  struct ec_reply reply;
+  int i, err;
+
+  memset (&req, 0, sizeof (req));
+  req.op = BROKER_READ;
+  for (i = 0; i < n; i++)
+    req.want[addrs[i] >> 3] |= 1 << (addrs[i] & 7);
+
+  if ((err = broker_call (ec, &req, &reply)) < 0)
+    return err;
+
+  for (i = 0; i < n; i++)
+    regs[addrs[i]] = reply.regs[addrs[i]];
+
+  return 0;
+}
+
+int
+broker_write (struct ec_session *ec, unsigned char addr, unsigned char data)
+{
+  struct ec_request req;
+  struct ec_reply reply;
+
+  memset (&req, 0, sizeof (req));
+  req.op = BROKER_WRITE;
+  req.addr = addr;
+  req.data = data;
+
+  return broker_call (ec, &req, &reply);
+}
+
+int
+broker_update (struct ec_session *ec, unsigned char addr, 
+               unsigned char clear, unsigned char set, unsigned char flip)
+{
+  struct ec_request req;
+  struct ec_reply reply;
+  int err;
+
+  memset (&req, 0, sizeof (req));
+  req.op = BROKER_UPDATE;
+  req.addr = addr;
+  req.clear = clear;
+  req.set = set;
+  req.flip = flip;
+
+  if ((err = broker_call (ec, &req, &reply)) < 0)
+    return err;
+
+  return reply.regs[addr];
+}
+
+/* 
+ * Shared memory snapshot 
+ *
+ * acer-ec --publish samples the whole register file each --interval 
+ * and publishes the image under a seqlock.  Readers map the segment 
+ * once; reading it afterwards costs no syscall and no EC traffic, and
+ * never blocks the sampler.
+ */
+int
+publish (struct ec_session *ec)
+{
+  struct ec_shm *shm;
+  uint64_t expired;
+  int a, fd, tfd, err;
+
+  fd = shm_open (ec->shm_name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1 || ftruncate (fd, sizeof (*shm)) == -1)
+    {
+      perror ("Error creating shared memory");
+      exit (EXIT_FAILURE);
+    }
+  shm = mmap (NULL, sizeof (*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (shm == MAP_FAILED)
+    {
+      perror ("Error mapping shared memory");
+      exit (EXIT_FAILURE);
+    }
+  shm->magic = SHM_MAGIC;
+
+  tfd = timer_start (interval * 1000000LL);
+  catch_signals ();
+
+  while (!interrupted)
+    {
+      stats_poll (ec);
+      snap_reset (&ec->snap);
+      for (a = 0; a < 256; a++)
+        snap_want (&ec->snap, a);
+
+      /* keep publishing through transient EC errors */
+      if ((err = snap_fill (ec)) < 0)
+        report (ec, err);
+      else
+        shm_publish (shm, &ec->snap);
+
+      if (read (tfd, &expired, sizeof (expired)) == -1 && errno != EINTR)
+        break;
+    }
+
+  close (tfd);
+  munmap (shm, sizeof (*shm));
+  shm_unlink (ec->shm_name);
+
+  return 0;
+}
+
+void
+shm_publish (struct ec_shm *shm, const struct ec_snapshot *snap)
+{
+  uint32_t seq = shm->seq;
+
+  __atomic_store_n (&shm->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  memcpy (shm->valid, snap->valid, sizeof (shm->valid));
+  memcpy (shm->regs, snap->regs, sizeof (shm->regs));
+  shm->timestamp = monotonic_ns ();
+  shm->generation++;
+
+  __atomic_store_n (&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* consistent copy of the segment, retried while the sampler writes */
+void
+shm_snapshot (const struct ec_shm *shm, struct ec_shm *copy)
+{
+  uint32_t seq;
+
+  for (;;)
+    {
+      seq = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        {
+          cpu_relax ();
+          continue;
+        }
+
+      memcpy (copy, shm, sizeof (*copy));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&shm->seq, __ATOMIC_RELAXED) == seq)
+        return;
     }
+}
 
-  outb (data, port);
+int
+shm_open_reader (struct ec_session *ec)
+{
+  struct ec_shm *shm;
+  struct stat st;
+  int fd;
+
+  fd = shm_open (ec->shm_name, O_RDONLY, 0);
+  if (fd == -1)
+    return -1;
+
+  if (fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (*shm))
+    {
+      close (fd);
+      errno = EINVAL;
+      return -1;
+    }
+
+  shm = mmap (NULL, sizeof (*shm), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (shm == MAP_FAILED)
+    return -1;
+
+  if (shm->magic != SHM_MAGIC)
+    {
+      munmap (shm, sizeof (*shm));
+      errno = EINVAL;
+      return -1;
+    }
+  ec->priv = shm;
+
+  return 0;
+}
+
+void
+shm_close_reader (struct ec_session *ec)
+{
+  munmap (ec->priv, sizeof (struct ec_shm));
+  ec->priv = NULL;
+}
+
+int
+shm_read_regs (struct ec_session *ec, const unsigned char *addrs, int n, 
+               unsigned char *regs)
+{
+  struct ec_shm copy;
+  int i;
+
+  shm_snapshot (ec->priv, &copy);
+  for (i = 0; i < n; i++)
+    {
+      if (!(copy.valid[addrs[i] >> 3] & (1 << (addrs[i] & 7))))
+        {
+          ec->error_reg = addrs[i];
+          return -EC_EIO;
+        }
+      regs[addrs[i]] = copy.regs[addrs[i]];
+    }
+
+  return 0;
+}
+
+int
+shm_write_reg (struct ec_session *ec, unsigned char addr, unsigned char data)
+{
+  (void) data;
+  ec->error_reg = addr;
+  return -EC_EPERM;
+}
+
+/* 
+ * Metrics export 
+ *
+ * --export=prometheus prints the metrics once.  --export=prometheus:FILE
+ * rewrites FILE each --interval for the node_exporter textfile 
+ * collector, through a temporary file renamed into place.  Only the 
+ * registers behind the metrics are read, in one pass.
+ */
+int
+export (struct ec_session *ec, const char *arg)
+{
+  const char *path = NULL;
+  uint64_t expired;
+  int tfd, err;
+
+  if (strncasecmp (arg, "prometheus", 10) != 0 
+      || (arg[10] != '\0' && arg[10] != ':'))
+    {
+      fprintf (stderr, "Unknown export format: %s\n", arg);
+      exit (EXIT_FAILURE);
+    }
+  if (arg[10] == ':')
+    path = arg + 11;
+
+  if (path == NULL)
+    return export_write (ec, NULL);
+
+  tfd = timer_start (interval * 1000000LL);
+  catch_signals ();
+
+  while (!interrupted)
+    {
+      stats_poll (ec);
+
+      /* keep the last good file through transient EC errors */
+      if ((err = export_write (ec, path)) < 0)
+        report (ec, err);
+
+      if (read (tfd, &expired, sizeof (expired)) == -1 && errno != EINTR)
+        break;
+    }
+  close (tfd);
+
+  return 0;
+}
+
+int
+export_write (struct ec_session *ec, const char *path)
+{
+  const struct ec_metric *m;
+  char *tmp;
+  FILE *f;
+  int fd, err;
+
+  snap_reset (&ec->snap);
+  for (m = metrics; m->name != NULL; m++)
+    want_field (&ec->snap, find_field (m->field));
+  if ((err = snap_fill (ec)) < 0)
+    return err;
+
+  if (path == NULL)
+    {
+      export_print (stdout, ec->snap.regs);
+      return 0;
+    }
+
+  if (asprintf (&tmp, "%s.XXXXXX", path) == -1 
+      || (fd = mkstemp (tmp)) == -1 || (f = fdopen (fd, "w")) == NULL)
+    {
+      perror ("Error writing metrics");
+      exit (EXIT_FAILURE);
+    }
+  fchmod (fd, 0644);
+  export_print (f, ec->snap.regs);
+  if (fclose (f) == EOF || rename (tmp, path) == -1)
+    {
+      perror ("Error writing metrics");
+      unlink (tmp);
+    }
+  free (tmp);
+
+  return 0;
+}
+
+void
+export_print (FILE *f, const unsigned char *regs)
+{
+  const struct ec_metric *m;
+  unsigned long v;
+
+  for (m = metrics; m->name != NULL; m++)
+    {
+      if (m->help != NULL)
+        fprintf (f, "# HELP %s %s\n# TYPE %s gauge\n", 
+                 m->name, m->help, m->name);
+
+      v = field_value (find_field (m->field), regs);
+      if (m->mask)
+        v = (v & m->mask) != 0;
+      if (m->label)
+        fprintf (f, "%s{%s} %.10g\n", m->name, m->label, v * m->scale);
+      else
+        fprintf (f, "%s %.10g\n", m->name, v * m->scale);
+    }
+}
+
+/* 
+ * Battery recorder 
+ *
+ * --record=FILE[:KB]: sample the battery every --interval into a ring 
+ * file of bounded size.  A sample costs one snapshot pass and a few 
+ * bytes written to the mapping.  An existing recording of the same 
+ * size is continued.
+ */
+int
+record (struct ec_session *ec, const char *arg)
+{
+  struct ec_ring *ring;
+  struct ec_ring_block *b = NULL;
+  const struct ec_field *f[RING_CHANNELS];
+  unsigned char *data, *p;
+  uint32_t v, last[RING_CHANNELS];
+  long long now, prev = 0;
+  struct timespec ts;
+  uint64_t expired;
+  char *path, *colon, *end;
+  size_t size;
+  long kb = RING_SIZE;
+  int i, tfd, err = 0;
+
+  if ((path = strdup (arg)) == NULL)
+    {
+      perror ("Error allocating path");
+      exit (EXIT_FAILURE);
+    }
+  /* FILE:KB, a colon not followed by a number belongs to the path */
+  if ((colon = strrchr (path, ':')) != NULL
+      && (kb = strtol (colon + 1, &end, 10), end != colon + 1 && *end == '\0'))
+    {
+      if (kb <= 0 || kb > INT_MAX / 1024)
+        {
+          fprintf (stderr, "Invalid size: %s\n", colon + 1);
+          exit (EXIT_FAILURE);
+        }
+      *colon = '\0';
+    }
+  else
+    kb = RING_SIZE;
+  if ((ring = ring_open (path, kb, &size)) == NULL)
+    exit (EXIT_FAILURE);
+  for (i = 0; i < RING_CHANNELS; i++)
+    f[i] = find_field (record_fields[i]);
+
+  tfd = timer_start (interval * 1000000LL);
+  catch_signals ();
+
+  while (!interrupted)
+    {
+      stats_poll (ec);
+      for (i = 0; i < RING_CHANNELS; i++)
+        {
+          snap_invalidate (&ec->snap, f[i]->offset);
+          want_field (&ec->snap, f[i]);
+        }
+      if ((err = snap_fill (ec)) < 0)
+        {
+          report (ec, err);
+          b = NULL;             /* gap, start over with a keyframe */
+        }
+      else
+        {
+          now = monotonic_ns () / 1000000LL;
+          if (b == NULL || b->used + RING_SAMPLE_MAX 
+              > RING_BLOCK - sizeof (*b))
+            {
+              ring->head = (ring->head + 1) % ring->blocks;
+              b = ring_block (ring, ring->head);
+              b->seq = 0;
+              clock_gettime (CLOCK_REALTIME, &ts);
+              b->time = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+              b->used = 0;
+              for (i = 0; i < RING_CHANNELS; i++)
+                b->key[i] = last[i] = field_value (f[i], ec->snap.regs);
+              b->seq = ++ring->seq;
+            }
+          else
+            {
+              data = (unsigned char *) (b + 1);
+              p = varint_put (data + b->used, now - prev);
+              for (i = 0; i < RING_CHANNELS; i++)
+                {
+                  v = field_value (f[i], ec->snap.regs);
+                  /* zigzag, small changes either way stay small */
+                  p = varint_put (p, ((v - last[i]) << 1) 
+                                  ^ -((v - last[i]) >> 31));
+                  last[i] = v;
+                }
+              b->used = p - data;
+            }
+          prev = now;
+        }
+      snap_reset (&ec->snap);
+
+      if (read (tfd, &expired, sizeof (expired)) == -1 && errno != EINTR)
+        break;
+    }
+
+  close (tfd);
+  munmap (ring, size);
+  free (path);
+  return 0;
+}
+
+/* map a ring file, formatting it unless it holds a recording of kb */
+struct ec_ring *
+ring_open (const char *path, long kb, size_t *size)
+{
+  struct ec_ring *ring;
+  uint32_t blocks = kb * 1024 / RING_BLOCK;
+  int fd;
+
+  if (blocks < 2)
+    {
+      fprintf (stderr, "Ring file too small: %ld kb\n", kb);
+      return NULL;
+    }
+  *size = (size_t) (blocks + 1) * RING_BLOCK;
+
+  fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1 || ftruncate (fd, *size) == -1)
+    {
+      perror ("Error opening ring file");
+      return NULL;
+    }
+  ring = mmap (NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (ring == MAP_FAILED)
+    {
+      perror ("Error mapping ring file");
+      return NULL;
+    }
+
+  if (ring->magic != RING_MAGIC || ring->version != RING_VERSION 
+      || ring->channels != RING_CHANNELS || ring->block_size != RING_BLOCK
+      || ring->blocks != blocks || ring->head >= blocks)
+    {
+      memset (ring, 0, *size);
+      ring->version = RING_VERSION;
+      ring->channels = RING_CHANNELS;
+      ring->block_size = RING_BLOCK;
+      ring->blocks = blocks;
+      ring->head = blocks - 1;
+      ring->magic = RING_MAGIC;
+    }
+
+  return ring;
+}
+
+struct ec_ring_block *
+ring_block (struct ec_ring *ring, uint32_t i)
+{
+  return (struct ec_ring_block *) ((char *) ring + (i + 1) * RING_BLOCK);
+}
+
+/* 
+ * --decode=FILE[:FROM-TO]: print the samples of a recording as CSV, 
+ * oldest first, optionally only those between two UNIX times.  Returns
+ * the exit status.
+ */
+int
+decode (const char *arg)
+{
+  struct ec_ring *ring;
+  struct stat st;
+  char *path, *colon, *end;
+  long long from = 0, to = LLONG_MAX;
+  uint32_t i, start, oldest = 0;
+  int fd, bad = 0;
+
+  if ((path = strdup (arg)) == NULL)
+    {
+      perror ("Error allocating path");
+      exit (EXIT_FAILURE);
+    }
+  if ((colon = strrchr (path, ':')) != NULL)
+    {
+      *colon = '\0';
+      if (colon[1] != '-')
+        from = strtod (colon + 1, &end) * 1000;
+      else
+        end = colon + 1;
+      if (*end != '-' || (end[1] != '\0' && (to = strtod (end + 1, &end)
+                                              * 1000, *end != '\0')))
+        {
+          fprintf (stderr, "Invalid range: %s\n", colon + 1);
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1 
+      || fstat (fd, &st) == -1)
+    {
+      perror ("Error opening ring file");
+      exit (EXIT_FAILURE);
+    }
+  ring = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (ring == MAP_FAILED || (size_t) st.st_size < sizeof (*ring)
+      || ring->magic != RING_MAGIC || ring->version != RING_VERSION
+      || ring->channels != RING_CHANNELS || ring->block_size != RING_BLOCK
+      || (size_t) st.st_size < (ring->blocks + 1) * (size_t) RING_BLOCK)
+    {
+      fprintf (stderr, "%s: not a recording\n", path);
+      exit (EXIT_FAILURE);
+    }
+
+  /* the block after the head is the oldest, unless it was never used */
+  start = (ring->head + 1) % ring->blocks;
+  for (i = 0; i < ring->blocks; i++)
+    if (ring_block (ring, (start + i) % ring->blocks)->seq != 0)
+      {
+        oldest = (start + i) % ring->blocks;
+        break;
+      }
+
+  printf ("time,%s,%s,%s,%s,%s\n", record_fields[0], record_fields[1], 
+          record_fields[2], record_fields[3], record_fields[4]);
+  for (i = 0; i < ring->blocks; i++)
+    {
+      const struct ec_ring_block *b;
+
+      b = ring_block (ring, (oldest + i) % ring->blocks);
+      if (b->seq != 0 && decode_block (b, RING_BLOCK, from, to) < 0)
+        bad++;
+    }
+  if (bad)
+    fprintf (stderr, "%s: %d damaged blocks\n", path, bad);
+
+  munmap (ring, st.st_size);
+  free (path);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* print the samples of one block between from and to (ms) */
+int
+decode_block (const struct ec_ring_block *b, size_t size, long long from,
+              long long to)
+{
+  const unsigned char *p = (const unsigned char *) (b + 1);
+  const unsigned char *end = p + b->used;
+  uint32_t v[RING_CHANNELS], d;
+  long long t = b->time;
+  int i;
+
+  if (b->used > size - sizeof (*b))
+    return -1;
+
+  memcpy (v, b->key, sizeof (v));
+  for (;;)
+    {
+      if (t >= from && t <= to)
+        printf ("%lld.%03lld,%u,%u,%u,%u,%u\n", t / 1000, t % 1000, 
+                v[0], v[1], v[2], v[3], v[4]);
+      if (p == end)
+        return 0;
+
+      if ((p = varint_get (p, end, &d)) == NULL)
+        return -1;
+      t += d;
+      for (i = 0; i < RING_CHANNELS; i++)
+        {
+          if ((p = varint_get (p, end, &d)) == NULL)
+            return -1;
+          v[i] += (d >> 1) ^ -(d & 1);
+        }
+    }
+}
+
+/* LEB128, 7 bits per byte, least significant first */
+unsigned char *
+varint_put (unsigned char *p, uint32_t v)
+{
+  while (v >= 0x80)
+    {
+      *p++ = v | 0x80;
+      v >>= 7;
+    }
+  *p++ = v;
+
+  return p;
+}
+
+const unsigned char *
+varint_get (const unsigned char *p, const unsigned char *end, uint32_t *v)
+{
+  int shift;
+
+  *v = 0;
+  for (shift = 0; p < end && shift < 35; shift += 7)
+    {
+      *v |= (uint32_t) (*p & 0x7f) << shift;
+      if (!(*p++ & 0x80))
+        return p;
+    }
+
+  return NULL;
+}
+
+/* 
+ * Statistics 
+ */
+void
+hist_add (struct ec_hist *h, long long ns)
+{
+  int i = ns > 0 ? 64 - __builtin_clzll (ns) : 0;
+
+  h->bucket[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+/* upper bound of the bucket holding the pct-th percentile */
+long long
+hist_percentile (const struct ec_hist *h, int pct)
+{
+  unsigned long seen = 0, rank = (h->count * pct + 99) / 100;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if ((seen += h->bucket[i]) >= rank && seen > 0)
+      break;
+  if (i == 0 || i == HIST_BUCKETS)
+    return i == 0 ? 0 : h->max;
+
+  return (1LL << i) < h->max ? (1LL << i) : h->max;
+}
+
+/* --stats: counters and latencies, on stderr */
+void
+stats_print (struct ec_session *ec, int format)
+{
+  const struct ec_stats *st = &ec->stats;
+  const struct ec_hist *hist[] = 
+    { &st->read, &st->write, &st->pass, &st->ibf, &st->obf, &st->lock, 
+      &st->rate };
+  const char *names[] = 
+    { "read", "write", "pass", "ibf", "obf", "lock", "rate" };
+  int i;
+
+  if (format == STATS_JSON)
+    {
+      fprintf (stderr, "{\"backend\":\"%s\",\"init_ns\":%lld,"
+               "\"transactions\":%lu,\"bytes_read\":%lu,"
+               "\"bytes_burst\":%lu,\"bytes_written\":%lu,"
+               "\"syscalls\":%lu,\"spins\":%lu,\"sleeps\":%lu,"
+               "\"retries\":%lu,\"recoveries\":%lu,"
+               "\"tear_retries\":%lu,\"bursts\":%lu,"
+               "\"snapshot_regs\":%lu,\"lock_waits\":%lu,"
+               "\"throttled\":%lu,\"events\":%lu,\"hooks\":%lu,"
+               "\"hooks_dropped\":%lu,\"latency\":{",
+               ec->backend->name, st->init_ns, st->transactions, 
+               st->bytes_read, st->burst_bytes, st->bytes_written, 
+               st->syscalls, st->spins, st->sleeps, st->retries, 
+               st->recoveries, st->tear_retries, st->bursts, 
+               st->snapshot_regs, st->lock_waits, st->throttled, 
+               st->events, st->hooks, st->hooks_dropped);
+      for (i = 0; i < 7; i++)
+        fprintf (stderr, "%s\"%s\":{\"count\":%lu,\"p50_ns\":%lld,"
+                 "\"p99_ns\":%lld,\"max_ns\":%lld}", i ? "," : "", 
+                 names[i], hist[i]->count, hist_percentile (hist[i], 50),
+                 hist_percentile (hist[i], 99), hist[i]->max);
+      fprintf (stderr, "}}\n");
+      return;
+    }
+
+  fprintf (stderr, "Statistics (%s backend)\n\n", ec->backend->name);
+  fprintf (stderr, "init_port      %10.3f ms\n", st->init_ns / 1e6);
+  fprintf (stderr, "transactions   %10lu\n", st->transactions);
+  fprintf (stderr, "bytes read     %10lu (byte mode %lu, burst %lu)\n", 
+           st->bytes_read, st->bytes_read - st->burst_bytes, 
+           st->burst_bytes);
+  fprintf (stderr, "bytes written  %10lu\n", st->bytes_written);
+  fprintf (stderr, "bursts         %10lu\n", st->bursts);
+  fprintf (stderr, "syscalls       %10lu\n", st->syscalls);
+  fprintf (stderr, "spins          %10lu\n", st->spins);
+  fprintf (stderr, "sleeps         %10lu\n", st->sleeps);
+  fprintf (stderr, "retries        %10lu\n", st->retries);
+  fprintf (stderr, "recoveries     %10lu\n", st->recoveries);
+  fprintf (stderr, "tear retries   %10lu\n", st->tear_retries);
+  fprintf (stderr, "lock waits     %10lu\n", st->lock_waits);
+  fprintf (stderr, "throttled      %10lu\n", st->throttled);
+  fprintf (stderr, "events         %10lu\n", st->events);
+  fprintf (stderr, "hooks          %10lu (dropped %lu)\n", st->hooks, 
+           st->hooks_dropped);
+  fprintf (stderr, "\n%-14s %10s %10s %10s %10s\n", 
+           "latency (us)", "count", "p50", "p99", "max");
+  for (i = 0; i < 7; i++)
+    fprintf (stderr, "%-14s %10lu %10.1f %10.1f %10.1f\n", names[i], 
+             hist[i]->count, hist_percentile (hist[i], 50) / 1e3, 
+             hist_percentile (hist[i], 99) / 1e3, hist[i]->max / 1e3);
+}
+
+/* 
+ * Benchmark 
+ *
+ * Without /dev/port the devport backend runs on a temporary file with
+ * the emulator behind it: each byte still goes through devport_in() 
+ * and devport_out(), pread and pwrite on the file.
+ */
+static const struct ec_backend stand_in =
+  {"devport/emul", stand_in_open, stand_in_close, stand_in_in, stand_in_out,
+   NULL, NULL, NULL};
+
+int
+stand_in_open (struct ec_session *ec)
+{
+  char path[] = "/tmp/acer-ec-devport.XXXXXX";
+
+  if ((ec->fd = mkstemp (path)) == -1)
+    return -1;
+  unlink (path);
+
+  return emul_open (ec);
+}
+
+void
+stand_in_close (struct ec_session *ec)
+{
+  emul_close (ec);
+  devport_close (ec);
+}
+
+unsigned char
+stand_in_in (struct ec_session *ec, unsigned char port)
+{
+  unsigned char data = emul_in (ec, port);
+
+  ec->stats.syscalls++;
+  pwrite (ec->fd, &data, 1, port);
+
+  return devport_in (ec, port);
+}
+
+void
+stand_in_out (struct ec_session *ec, unsigned char data, unsigned char port)
+{
+  unsigned char back;
+
+  devport_out (ec, data, port);
+  ec->stats.syscalls++;
+  if (pread (ec->fd, &back, 1, port) == 1)
+    emul_out (ec, back, port);
+}
+
+void
+bench (struct ec_session *ec, int runs)
+{
+  const struct ec_backend *b;
+  struct ec_session other;
+  int opened, no_burst = ec->no_burst;
+
+  if (runs <= 0)
+    runs = 10;
+
+  printf ("Benchmark (%s backend, %d runs)\n\n", ec->backend->name, runs);
+  printf ("%-16s %10s %10s %10s %10s %10s\n", 
+          "command", "trans/run", "trans/s", "ms/run", "us/byte", 
+          "syscalls");
+
+  ec->no_burst = 1;
+  bench_run (ec, "status", show_status, runs);
+  bench_run (ec, "dump", dump_fields, runs);
+  bench_run (ec, "registers", dump_regs, runs);
+
+  ec->no_burst = no_burst;
+  if (!ec->no_burst)
+    {
+      bench_run (ec, "status/burst", show_status, runs);
+      bench_run (ec, "dump/burst", dump_fields, runs);
+      bench_run (ec, "registers/burst", dump_regs, runs);
+    }
+
+  /* registers through every direct backend */
+  printf ("\n%-16s %10s %10s %10s %10s %10s\n", 
+          "backend", "trans/run", "trans/s", "ms/run", "us/byte", 
+          "syscalls");
+  for (b = backends; b->name != NULL; b++)
+    {
+      if (strcmp (b->name, "broker") == 0 || strcmp (b->name, "shm") == 0
+          || strcmp (b->name, "replay") == 0)
+        continue;
+
+      other = *ec;
+      other.backend = b;
+      other.fd = -1;
+      other.priv = NULL;
+      other.lock_fd = -1;
+      other.lock_depth = 0;
+      other.tracer = NULL;
+      opened = b->open (&other) == 0;
+      if (!opened && b->open == devport_open)
+        {
+          other.backend = &stand_in;
+          opened = stand_in.open (&other) == 0;
+        }
+      if (!opened)
+        {
+          printf ("%-16s %10s\n", b->name, "unavailable");
+          continue;
+        }
+      /* live ports: keep other acer-ec processes out, as any session */
+      other.opened = 1;
+      lock_open (&other);
+      bench_run (&other, other.backend->name, dump_regs, runs);
+      other.backend->close (&other);
+      if (other.lock_fd != -1)
+        close (other.lock_fd);
+    }
+
+  /* concurrent processes on one emulator */
+  printf ("\nConcurrent (shared emulator, all registers, %d runs each)\n\n", 
+          runs);
+  printf ("%-16s %10s %10s %10s %10s\n", 
+          "processes", "trans/s", "waits/tx", "wait us/tx", "errors");
+  bench_stress (ec, 1, runs);
+  bench_stress (ec, 2, runs);
+  bench_stress (ec, 4, runs);
+  bench_stress (ec, 8, runs);
+}
+
+/* 
+ * procs processes read all registers of an emulator in shared memory,
+ * serialized by the EC lock on a temporary file.  Every register must 
+ * read back as the image holds it.
+ */
+void
+bench_stress (struct ec_session *ec, int procs, int runs)
+{
+  struct ec_session c;
+  struct ec_emul *shared;
+  struct ec_stress r, total;
+  unsigned char image[256];
+  char lock[] = "/tmp/acer-ec-bench.XXXXXX";
+  long long start, elapsed;
+  int i, a, fd, pipefd[2];
+  pid_t pid;
+
+  c = *ec;
+  c.backend = find_backend ("emul");
+  c.static_path = NULL;
+  c.tracer = NULL;
+  c.lock_depth = 0;
+  emul_open (&c);
+  shared = mmap (NULL, sizeof (*shared), PROT_READ | PROT_WRITE, 
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED || pipe (pipefd) == -1 
+      || (fd = mkstemp (lock)) == -1)
+    {
+      perror ("Error setting up stress test");
+      exit (EXIT_FAILURE);
+    }
+  close (fd);
+  *shared = *(struct ec_emul *) c.priv;
+  shared->churn = shared->drop = 0;
+  memcpy (image, shared->regs, sizeof (image));
+  c.priv = shared;
+  fflush (stdout);
+
+  start = monotonic_ns ();
+  for (i = 0; i < procs; i++)
+    {
+      if ((pid = fork ()) == -1)
+        {
+          perror ("Error forking");
+          exit (EXIT_FAILURE);
+        }
+      if (pid > 0)
+        continue;
+
+      /* flock() locks belong to the open file, each process opens it */
+      c.lock_fd = open (lock, O_RDONLY | O_CLOEXEC);
+      memset (&c.stats, 0, sizeof (c.stats));
+      memset (&r, 0, sizeof (r));
+      for (i = 0; i < runs; i++)
+        {
+          snap_reset (&c.snap);
+          for (a = 0; a < 256; a++)
+            snap_want (&c.snap, a);
+          if (snap_fill (&c) < 0)
+            r.errors++;
+          else
+            for (a = 0; a < 256; a++)
+              r.errors += c.snap.regs[a] != image[a];
+        }
+      r.transactions = c.stats.transactions;
+      r.lock_waits = c.stats.lock_waits;
+      r.lock_ns = c.stats.lock.sum;
+      write (pipefd[1], &r, sizeof (r));
+      _exit (EXIT_SUCCESS);
+    }
+
+  memset (&total, 0, sizeof (total));
+  for (i = 0; i < procs && read (pipefd[0], &r, sizeof (r)) == sizeof (r); 
+       i++)
+    {
+      total.transactions += r.transactions;
+      total.lock_waits += r.lock_waits;
+      total.lock_ns += r.lock_ns;
+      total.errors += r.errors;
+    }
+  while (wait (NULL) > 0)
+    ;
+  elapsed = monotonic_ns () - start;
+
+  printf ("%-16d %10.0f %10.3f %10.2f %10lu\n", procs,
+          total.transactions * 1e9 / elapsed, 
+          (double) total.lock_waits / total.transactions,
+          total.lock_ns / 1e3 / total.transactions, total.errors);
+
+  close (pipefd[0]);
+  close (pipefd[1]);
+  unlink (lock);
+  munmap (shared, sizeof (*shared));
+}
+
+void
+bench_run (struct ec_session *ec, const char *name, 
+           int (*cmd) (struct ec_session *), int runs)
+{
+  int i, saved, null;
+  long long start, elapsed;
+
+  /* discard command output */
+  fflush (stdout);
+  saved = dup (STDOUT_FILENO);
+  null = open ("/dev/null", O_WRONLY);
+  if (saved == -1 || null == -1)
+    {
+      perror ("Error redirecting output");
+      exit (EXIT_FAILURE);
+    }
+  dup2 (null, STDOUT_FILENO);
+  close (null);
+
+  memset (&ec->stats, 0, sizeof (ec->stats));
+  start = monotonic_ns ();
+  for (i = 0; i < runs; i++)
+    {
+      snap_reset (&ec->snap);
+      cmd (ec);
+      fflush (stdout);
+    }
+  elapsed = monotonic_ns () - start;
+
+  dup2 (saved, STDOUT_FILENO);
+  close (saved);
+
+  printf ("%-16s %10lu %10.0f %10.3f %10.2f %10lu\n", name, 
+          ec->stats.transactions / runs,
+          ec->stats.transactions * 1e9 / elapsed, elapsed / 1e6 / runs,
+          elapsed / 1e3 / (ec->stats.bytes_read + ec->stats.bytes_written),
+          ec->stats.syscalls / runs);
 }